@@ -0,0 +1,29 @@
+#!/bin/sh
+# Builds the benches for the PC this runs on
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+FLAGS="-O2 -std=gnu++17 -DESP8266 -Ishim"
+$CXX $FLAGS -I../../src -o stepper_bench \
+  stepper_bench.cpp ../../src/lib/ShiftStepper.cpp "$@" || exit 1
+
+# The command bench runs the real command table against the mock Evebrain
+# (found ahead of the real one), so the rows are taken from Evebrain.cpp
+mkdir -p gen
+sed -n 's/^ *{\("[A-Za-z0-9_]*"\), *&Evebrain::\([A-Za-z0-9_]*\), *\(.*[^ ]\) *, *\([0-9]*\)},.*$/CMD_ROW(\1, \2, \3, \4)/p' \
+  ../../src/Evebrain.cpp > gen/cmds.inc
+$CXX $FLAGS -Imock -Igen -I../../src -o cmd_bench \
+  cmd_bench.cpp mock/Evebrain.cpp frame_codec.cpp ../../src/lib/CmdProcessor.cpp \
+  ../../src/lib/CmdQueue.cpp ../../src/lib/ResponseCache.cpp \
+  ../../src/lib/ArduinoJson/*.cpp ../../src/lib/ArduinoJson/Internals/*.cpp \
+  -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc "$@"  || exit 1
+
+# The jitter bench is built again against ShiftStepper from before the step
+# rate accumulator, taken from the git history
+$CXX $FLAGS -I../../src -o jitter_new jitter_bench.cpp ../../src/lib/ShiftStepper.cpp "$@" || exit 1
+mkdir -p gen/old/lib
+if git show 8aa494b^:src/lib/ShiftStepper.h > gen/old/lib/ShiftStepper.h 2> /dev/null &&
+   git show 8aa494b^:src/lib/ShiftStepper.cpp > gen/old/lib/ShiftStepper.cpp 2> /dev/null; then
+  $CXX $FLAGS -Igen/old -o jitter_old jitter_bench.cpp gen/old/lib/ShiftStepper.cpp "$@"
+else
+  echo "No git history, so jitter_old isn't built"
+fi
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Builds the benches and checks their output against the references, failing
+# if anything has changed. After a change that is meant to move the steps,
+# check the new trace is right and copy its sha256sum into reference/.
+cd "$(dirname "$0")"
+./build.sh || exit 1
+fail=0
+
+./stepper_bench mixed mixed.trace > /dev/null &&
+  sha256sum -c --quiet reference/mixed.trace.sha256 ||
+  { echo "FAIL: mixed.trace differs from the reference"; fail=1; }
+
+./stepper_bench slack || { echo "FAIL: slack"; fail=1; }
+
+./jitter_new check || { echo "FAIL: step jitter"; fail=1; }
+
+# Each session's responses must be just as they were. After a change that is
+# meant to alter them, check the new ones and save them over the .out file.
+for session in sessions/*.txt; do
+  ./cmd_bench replay "$session" | diff -u "${session%.txt}.out" - ||
+    { echo "FAIL: $session"; fail=1; }
+done
+
+[ $fail = 0 ] && echo "All checks passed"
+exit $fail
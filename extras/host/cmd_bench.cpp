@@ -0,0 +1,379 @@
+// Runs CmdProcessor off the board, with the real command table, queue,
+// response cache and ArduinoJson, against the mock Evebrain in mock/, to see
+// what a change to dispatch or serialisation does without flashing a robot.
+//
+//   cmd_bench replay session               runs a session, printing each
+//                                          message and the responses to it
+//   cmd_bench bench session [runs]         runs a session over and over
+//                                          (1000 times by default): time per
+//                                          message, allocations and the
+//                                          deepest the stack went
+//   cmd_bench lookup [rounds]              times finding every command in
+//                                          the table, by binary search and
+//                                          by the linear scan it replaced
+//   cmd_bench codec [count]                sends the same commands as JSON
+//                                          and as binary frames (made with
+//                                          frame_codec), for their sizes and
+//                                          the messages handled a second
+//
+// A session is a text file with one message a line:
+//   {"cmd":"forward","arg":"100","id":"a"}  a JSON message (or batch)
+//   bin 0c 01 61 03 313030                  a binary frame, in hex
+//   wait 500                                lets 500ms go by
+// Blank lines and lines starting with # are skipped.
+//
+// Time is simulated: it only moves on in a wait, jumping from one event (a
+// move or slow command finishing) to the next. Timings are from the PC, so
+// only compare them with each other.
+#include "Arduino.h"
+#include "Evebrain.h"
+#include "frame_codec.h"
+#include <chrono>
+#include <string>
+#include <vector>
+#include <ucontext.h>
+
+HardwareSerial Serial;
+Evebrain evebrain;
+
+static unsigned long now = 0;
+unsigned long millis(){ return now; }
+unsigned long micros(){ return now * 1000; }
+
+// Every allocation the code under test makes goes through these (the link
+// wraps malloc and friends), and they're counted while counting is set
+static bool counting = false;
+static unsigned long allocs = 0, allocBytes = 0;
+extern "C" {
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void *__wrap_malloc(size_t n){
+  if(counting){ allocs++; allocBytes += n; }
+  return __real_malloc(n);
+}
+void *__wrap_calloc(size_t n, size_t size){
+  if(counting){ allocs++; allocBytes += n * size; }
+  return __real_calloc(n, size);
+}
+void *__wrap_realloc(void *p, size_t n){
+  if(counting){ allocs++; allocBytes += n; }
+  return __real_realloc(p, n);
+}
+}
+
+struct Line {
+  bool binary;
+  unsigned long wait;
+  // The message, or the frame's bytes
+  std::string text;
+  std::string source;
+};
+
+static std::vector<Line> session;
+static bool echo = false;
+static unsigned long responses = 0;
+
+// Time of the last response printed, so the time is given when it moves on
+static unsigned long printedAt = 0;
+
+static void output(const char *msg, size_t len){
+  responses++;
+  if(!echo) return;
+  if(now != printedAt){
+    printf("-- %lums\n", now);
+    printedAt = now;
+  }
+  printf("<< %.*s\n", (int)len, msg);
+}
+
+static bool load(const char *path){
+  FILE *f = fopen(path, "r");
+  if(!f){
+    perror(path);
+    return false;
+  }
+  char buf[1024];
+  while(fgets(buf, sizeof(buf), f)){
+    size_t len = strcspn(buf, "\r\n");
+    buf[len] = 0;
+    if(!len || buf[0] == '#') continue;
+    Line line = {false, 0, "", buf};
+    if(!strncmp(buf, "wait ", 5)){
+      line.wait = strtoul(&buf[5], NULL, 10);
+    }else if(!strncmp(buf, "bin ", 4)){
+      line.binary = true;
+      int hi = -1;
+      for(char *c = &buf[4]; *c; c++){
+        if(!isxdigit(*c)) continue;
+        int v = isdigit(*c) ? *c - '0' : tolower(*c) - 'a' + 10;
+        if(hi < 0){
+          hi = v;
+        }else{
+          line.text += (char)(hi << 4 | v);
+          hi = -1;
+        }
+      }
+    }else{
+      line.text = buf;
+    }
+    session.push_back(line);
+  }
+  fclose(f);
+  return true;
+}
+
+// Runs loop() passes until one does nothing, as the real loop would in the
+// same millisecond
+static void passes(){
+  unsigned long before;
+  do{
+    before = responses;
+    evebrain.checkReady();
+  }while(responses != before);
+}
+
+static void wait(unsigned long ms){
+  unsigned long until = now + ms;
+  passes();
+  while(now != until){
+    unsigned long next = evebrain.nextEvent();
+    now = next > now && next < until ? next : until;
+    passes();
+  }
+}
+
+static void send(const Line &line){
+  if(line.binary){
+    cmdProcessor.processBinaryMsg((const uint8_t *)line.text.data(), line.text.size());
+  }else{
+    // parsed in place, as the serial and websocket buffers are (and not on
+    // the stack, which is measured)
+    static char msg[1024];
+    strcpy(msg, line.text.c_str());
+    cmdProcessor.processMsg(msg);
+  }
+}
+
+static int replay(const char *path){
+  if(!load(path)) return 1;
+  echo = true;
+  for(size_t i = 0; i < session.size(); i++){
+    const Line &line = session[i];
+    if(line.wait){
+      wait(line.wait);
+    }else{
+      printf(">> %s\n", line.source.c_str());
+      send(line);
+      passes();
+    }
+  }
+  return 0;
+}
+
+// The bench runs on a stack of its own, filled with a pattern first, so the
+// deepest it went is where the pattern stops
+#define BENCH_STACK_LENGTH (256 * 1024)
+#define STACK_PATTERN 0xA5
+static uint8_t benchStack[BENCH_STACK_LENGTH];
+static ucontext_t mainContext, benchContext;
+static uint8_t *stackTop;
+static int benchRuns;
+static unsigned long messages;
+static double seconds;
+
+static void benchRun(){
+  // only the stack below here is counted, not the bench's own way in
+  uint8_t here;
+  stackTop = &here;
+  for(int run = 0; run < benchRuns; run++){
+    for(size_t i = 0; i < session.size(); i++){
+      const Line &line = session[i];
+      auto start = std::chrono::steady_clock::now();
+      counting = true;
+      if(line.wait){
+        wait(line.wait);
+      }else{
+        send(line);
+        passes();
+        messages++;
+      }
+      counting = false;
+      seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    // finish off, then let the cached responses expire so the next run
+    // isn't answered from the cache
+    while(!evebrain.idle()) wait(MOCK_CMD_MS);
+    now += RESPONSE_CACHE_MS;
+  }
+}
+
+static int bench(const char *path, int runs){
+  if(!load(path)) return 1;
+  benchRuns = runs;
+  memset(benchStack, STACK_PATTERN, sizeof(benchStack));
+  getcontext(&benchContext);
+  benchContext.uc_stack.ss_sp = benchStack;
+  benchContext.uc_stack.ss_size = sizeof(benchStack);
+  benchContext.uc_link = &mainContext;
+  makecontext(&benchContext, benchRun, 0);
+  swapcontext(&mainContext, &benchContext);
+
+  size_t deepest = 0;
+  while(deepest < sizeof(benchStack) && benchStack[deepest] == STACK_PATTERN) deepest++;
+  printf("%s: %d runs of %lu messages, %lu responses\n", path, runs,
+         messages / runs, responses / runs);
+  printf("  %.2f us per message, %.0f messages/s\n",
+         seconds * 1e6 / messages, messages / seconds);
+  printf("  %.2f allocations (%.1f bytes) per message\n",
+         (double)allocs / messages, (double)allocBytes / messages);
+  printf("  deepest stack %ld bytes\n", (long)(stackTop - &benchStack[deepest]));
+  return 0;
+}
+
+static int compares;
+
+static int compare(const char *name, const Cmd &cmd){
+  compares++;
+  return strcmp_P(name, cmd.cmd);
+}
+
+// How commands were found before the table was sorted: a strcmp against each
+// one in turn
+static int linearFind(const char *name){
+  for(int i = 0; i < Evebrain::cmdCount; i++){
+    if(!compare(name, Evebrain::cmds[i])) return i;
+  }
+  return -1;
+}
+
+// The binary search in CmdProcessor::findCmd
+static int sortedFind(const char *name){
+  int low = 0;
+  int high = Evebrain::cmdCount - 1;
+  while(low <= high){
+    int mid = (low + high) / 2;
+    int res = compare(name, Evebrain::cmds[mid]);
+    if(res == 0){
+      return mid;
+    }else if(res < 0){
+      high = mid - 1;
+    }else{
+      low = mid + 1;
+    }
+  }
+  return -1;
+}
+
+static void timeLookup(const char *label, int (*find)(const char *), int rounds){
+  char names[Evebrain::cmdCount][CMD_NAME_LENGTH];
+  for(int i = 0; i < Evebrain::cmdCount; i++) strcpy_P(names[i], Evebrain::cmds[i].cmd);
+  int most = 0;
+  const char *worst = "";
+  compares = 0;
+  for(int i = 0; i < Evebrain::cmdCount; i++){
+    int before = compares;
+    if(find(names[i]) != i) printf("%s didn't find %s\n", label, names[i]);
+    if(compares - before > most){
+      most = compares - before;
+      worst = names[i];
+    }
+  }
+  double perLookup = (double)compares / Evebrain::cmdCount;
+  volatile int sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(int r = 0; r < rounds; r++){
+    for(int i = 0; i < Evebrain::cmdCount; i++) sink += find(names[i]);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  printf("  %-14s %5.1f compares a lookup (most %d, for %s), %6.1f ns a lookup\n",
+         label, perLookup, most, worst, ns / rounds / Evebrain::cmdCount);
+}
+
+static int lookup(int rounds){
+  printf("finding each of the %d commands, %d times over:\n", Evebrain::cmdCount, rounds);
+  timeLookup("linear scan", linearFind, rounds);
+  timeLookup("binary search", sortedFind, rounds);
+  return 0;
+}
+
+struct CodecSample {
+  const char *cmd;
+  const char *arg;
+};
+
+// Commands sent at a high rate to control the robot, which complete straight
+// away so they can be sent over and over
+static const CodecSample codecSamples[] = {
+  {"drive", "{\"leftSpeed\":0.5,\"rightSpeed\":-0.5}"},
+  {"gpio_pwm_5", "512"},
+  {"ping", ""},
+};
+
+static uint8_t opcodeOf(const char *name){
+  for(int i = 0; i < Evebrain::cmdCount; i++){
+    if(!strcmp_P(name, Evebrain::cmds[i].cmd)) return pgm_read_byte(&Evebrain::cmds[i].opcode);
+  }
+  return 0;
+}
+
+static int codec(int count){
+  printf("%d of each, with a new id each time:\n", count);
+  for(const CodecSample &sample : codecSamples){
+    uint8_t opcode = opcodeOf(sample.cmd);
+    static char json[JSON_BUFFER_LENGTH];
+    uint8_t frame[FRAME_MAX_LENGTH];
+    char id[CMD_ID_LENGTH];
+    size_t jsonBytes = 0, frameBytes = 0;
+    double jsonSeconds = 0, frameSeconds = 0;
+    Frame decoded;
+    for(int i = 0; i < count; i++){
+      snprintf(id, sizeof(id), "%x", i);
+      // an object arg goes in as it is, anything else as a string
+      const char *format = !sample.arg[0] ? "{\"cmd\":\"%s\",\"id\":\"%s\"}" :
+                           sample.arg[0] == '{' ? "{\"cmd\":\"%s\",\"id\":\"%s\",\"arg\":%s}" :
+                           "{\"cmd\":\"%s\",\"id\":\"%s\",\"arg\":\"%s\"}";
+      size_t len = snprintf(json, sizeof(json), format, sample.cmd, id, sample.arg);
+      jsonBytes += len;
+      auto start = std::chrono::steady_clock::now();
+      cmdProcessor.processMsg(json);
+      jsonSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      len = encodeFrame(frame, sizeof(frame), opcode, id, sample.arg);
+      if(!len || !decodeFrame(frame, len, decoded) || decoded.opcode != opcode){
+        printf("%s: frame didn't encode\n", sample.cmd);
+        return 1;
+      }
+      frameBytes += len;
+      start = std::chrono::steady_clock::now();
+      cmdProcessor.processBinaryMsg(frame, len);
+      frameSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    printf("  %-10s JSON %5.1f bytes %8.0f msg/s, binary %5.1f bytes %8.0f msg/s (%.2fx)\n",
+           sample.cmd, (double)jsonBytes / count, count / jsonSeconds,
+           (double)frameBytes / count, count / frameSeconds, jsonSeconds / frameSeconds);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  evebrain.initCmds();
+  cmdProcessor.addOutputHandler(output);
+  if(argc == 3 && !strcmp(argv[1], "replay")){
+    return replay(argv[2]);
+  }
+  if((argc == 3 || argc == 4) && !strcmp(argv[1], "bench")){
+    return bench(argv[2], argc == 4 ? atoi(argv[3]) : 1000);
+  }
+  if((argc == 2 || argc == 3) && !strcmp(argv[1], "lookup")){
+    return lookup(argc == 3 ? atoi(argv[2]) : 100000);
+  }
+  if((argc == 2 || argc == 3) && !strcmp(argv[1], "codec")){
+    return codec(argc == 3 ? atoi(argv[2]) : 100000);
+  }
+  fprintf(stderr, "usage: cmd_bench replay session\n"
+                  "       cmd_bench bench session [runs]\n"
+                  "       cmd_bench lookup [rounds]\n"
+                  "       cmd_bench codec [count]\n");
+  return 2;
+}
@@ -0,0 +1,39 @@
+#include "frame_codec.h"
+#include <string.h>
+
+size_t encodeFrame(uint8_t *buf, size_t size, uint8_t opcode, const char *id, const char *arg){
+  size_t idLength = strlen(id);
+  size_t argLength = strlen(arg);
+  size_t len = 3 + idLength + argLength;
+  if(len > FRAME_MAX_LENGTH || len > size) return 0;
+  buf[0] = opcode;
+  buf[1] = idLength;
+  memcpy(&buf[2], id, idLength);
+  buf[2 + idLength] = argLength;
+  memcpy(&buf[3 + idLength], arg, argLength);
+  return len;
+}
+
+size_t encodeSerialFrame(uint8_t *buf, size_t size, uint8_t opcode, const char *id, const char *arg){
+  if(size < 2) return 0;
+  size_t len = encodeFrame(&buf[2], size - 2, opcode, id, arg);
+  if(!len) return 0;
+  buf[0] = FRAME_SERIAL_START;
+  buf[1] = len;
+  return len + 2;
+}
+
+bool decodeFrame(const uint8_t *buf, size_t len, Frame &out){
+  // the same checks as processBinaryMsg
+  if(len < 3 || len > FRAME_MAX_LENGTH) return false;
+  size_t idLength = buf[1];
+  if(idLength + 3 > len) return false;
+  size_t argLength = buf[2 + idLength];
+  if(argLength + idLength + 3 != len) return false;
+  out.opcode = buf[0];
+  out.id = (const char *)&buf[2];
+  out.idLength = idLength;
+  out.arg = (const char *)&buf[3 + idLength];
+  out.argLength = argLength;
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef __frame_codec_h__
+#define __frame_codec_h__
+
+// Encodes and decodes the compact binary command frames taken by
+// CmdProcessor::processBinaryMsg, for programs on a PC that talk to the robot:
+//
+//   opcode | id length | id | arg length | arg
+//
+// The opcode is the one given for the command in the table in
+// src/Evebrain.cpp, and the arg is the text that would go in the JSON "arg"
+// (a JSON object for commands such as speedMove). Over a websocket a frame is
+// sent as a binary message. Over serial it follows FRAME_SERIAL_START and a
+// byte giving its length.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_MAX_LENGTH 255
+#define FRAME_SERIAL_START 0x02
+
+struct Frame {
+  uint8_t opcode;
+  // Not null terminated, they point into the frame
+  const char *id;
+  uint8_t idLength;
+  const char *arg;
+  uint8_t argLength;
+};
+
+// Writes the frame for a command into buf. Returns its length, or 0 if it's
+// longer than FRAME_MAX_LENGTH or size.
+size_t encodeFrame(uint8_t *buf, size_t size, uint8_t opcode, const char *id, const char *arg);
+// As encodeFrame, with the serial start and length bytes in front
+size_t encodeSerialFrame(uint8_t *buf, size_t size, uint8_t opcode, const char *id, const char *arg);
+// Splits a frame up into its parts. Returns false if its lengths don't add up,
+// as the robot would answer it with "Binary frame error".
+bool decodeFrame(const uint8_t *buf, size_t len, Frame &out);
+
+#endif
@@ -0,0 +1,89 @@
+// Times the steps of one motor at part speeds, calling the timer interrupt
+// directly. build.sh builds it against the ShiftStepper in src as jitter_new,
+// and against the one from before the step rate accumulator (8aa494b^) as
+// jitter_old, which ran batches of steps at full speed with idle gaps between
+// them. Only what both have is used: turn, setRelSpeed, ready and triggerTop.
+// The ramp is turned off, as the old one only ramped full speed moves.
+//
+//   jitter_new            the gaps between steps at each speed
+//   jitter_new check      fails if any gap is more than a tick off the
+//                         gap the speed should give
+#include "Arduino.h"
+#include <SPI.h>
+#include "lib/ShiftStepper.h"
+#include <math.h>
+#include <vector>
+
+EspClass ESP;
+SPIClass SPI;
+volatile uint32_t GPOS, GPOC, SPI1W0, SPI1CMD, SPI1U1;
+
+// Simulated time, in 50us ticks
+static uint64_t ticks = 0;
+static uint32_t timerCycles = 0;
+static uint8_t lastBits = 0;
+static std::vector<uint64_t> stepTicks;
+
+uint32_t EspClass::getCycleCount(){ return ticks * BASE_INTERRUPT_US * clockCyclesPerMicrosecond(); }
+void timer1_disable(){}
+void timer1_isr_init(){}
+void timer1_attachInterrupt(timercallback){}
+void timer1_enable(uint8_t, uint8_t, uint8_t){}
+void timer1_write(uint32_t cycles){ timerCycles = cycles; }
+void pinMode(uint8_t, uint8_t){}
+void digitalWrite(uint8_t, uint8_t){}
+// Only one motor moves, so every new set of bits is one of its steps
+void shiftOut(uint8_t, uint8_t, uint8_t, uint8_t bits){
+  if(bits && bits != lastBits) stepTicks.push_back(ticks);
+  lastBits = bits;
+}
+
+ShiftStepper rightMotor(5);
+ShiftStepper leftMotor(1);
+
+#define JITTER_STEPS 400
+// Full speed with the ramp off, which is the same in both
+#define JITTER_FULL_SPEED_US 1500
+
+static const float speeds[] = {1, 0.75, 0.5, 0.37, 0.3, 0.1};
+
+int main(int argc, char **argv){
+  bool check = argc == 2 && !strcmp(argv[1], "check");
+  bool failed = false;
+  ShiftStepper::setup(12, 13, 14);
+  ShiftStepper::setAcceleration(0);
+  printf("speed  gap us  mean gap  min   max   sd    most off\n");
+  for(float speed : speeds){
+    stepTicks.clear();
+    rightMotor.setRelSpeed(speed);
+    rightMotor.turn(JITTER_STEPS, FORWARD);
+    while(!rightMotor.ready()){
+      ticks += timerCycles / (BASE_INTERRUPT_US * clockCyclesPerMicrosecond());
+      ShiftStepper::triggerTop();
+    }
+    double ideal = JITTER_FULL_SPEED_US / speed;
+    double sum = 0, sumSq = 0, minGap = 1e9, maxGap = 0, worst = 0;
+    size_t gaps = stepTicks.size() - 1;
+    for(size_t i = 1; i < stepTicks.size(); i++){
+      double gap = (double)(stepTicks[i] - stepTicks[i - 1]) * BASE_INTERRUPT_US;
+      sum += gap;
+      sumSq += gap * gap;
+      if(gap < minGap) minGap = gap;
+      if(gap > maxGap) maxGap = gap;
+      if(fabs(gap - ideal) > worst) worst = fabs(gap - ideal);
+    }
+    double mean = sum / gaps;
+    printf("%5.2f  %6.0f  %8.1f  %4.0f  %5.0f %5.0f %6.0f\n", speed, ideal, mean,
+           minGap, maxGap, sqrt(sumSq / gaps - mean * mean), worst);
+    if(stepTicks.size() != JITTER_STEPS){
+      printf("  took %d steps, not %d\n", (int)stepTicks.size(), JITTER_STEPS);
+      failed = true;
+    }
+    if(worst > BASE_INTERRUPT_US) failed = true;
+  }
+  if(check){
+    puts(failed ? "FAIL: steps more than a tick out" : "OK");
+    return failed;
+  }
+  return 0;
+}
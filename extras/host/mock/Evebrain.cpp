@@ -0,0 +1,92 @@
+#include "Evebrain.h"
+
+CmdProcessor cmdProcessor;
+
+const Cmd Evebrain::cmds[] PROGMEM = {
+#define CMD_ROW(name, fn, flags, opcode) {name, &Evebrain::fn, flags, opcode},
+#include "cmds.inc"
+#undef CMD_ROW
+};
+const int Evebrain::cmdCount = sizeof(cmds) / sizeof(cmds[0]);
+
+#define CMD_ROW(name, fn, flags, opcode) \
+  void Evebrain::fn(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){ \
+    run(name, flags, inJson, outJson); \
+  }
+#include "cmds.inc"
+#undef CMD_ROW
+
+Evebrain::Evebrain(){
+  queuedSeq = 0;
+  doneSeq = 0;
+  busyUntil = 0;
+}
+
+void Evebrain::initCmds(){
+  cmdProcessor.setEvebrain(*this);
+  cmdProcessor.setCmds(cmds, cmdCount);
+}
+
+void Evebrain::run(const char *cmd, uint8_t flags, ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
+  if(!strcmp(cmd, "stop")){
+    cmdProcessor.cancelQueue();
+    doneSeq = queuedSeq;
+    busyUntil = millis();
+  }else if(!strcmp(cmd, "stats")){
+    const char *id = inJson["id"];
+    const char *name = inJson["arg"];
+    if(!cmdProcessor.sendStats(id ? id : "", name ? name : "")){
+      outJson["status"] = "error";
+      outJson["msg"] = "Command not recognised";
+    }
+  }else if(!strcmp(cmd, "version")){
+    outJson["msg"] = "host";
+  }else if(flags & CMD_STREAM){
+    if((uint16_t)(queuedSeq - doneSeq) >= MOCK_SEGMENTS){
+      outJson["status"] = "error";
+      outJson["msg"] = "Too many moves queued";
+      return;
+    }
+    const char *arg = inJson["arg"];
+    unsigned long start = millis();
+    if(queuedSeq != doneSeq && segmentEnd[queuedSeq % MOCK_SEGMENTS] > start){
+      start = segmentEnd[queuedSeq % MOCK_SEGMENTS];
+    }
+    queuedSeq++;
+    segmentEnd[queuedSeq % MOCK_SEGMENTS] = start + (arg ? abs(atoi(arg)) * MOCK_MS_PER_UNIT : MOCK_CMD_MS);
+    cmdProcessor.completeAfter(queuedSeq);
+  }else if(!(flags & CMD_IMMEDIATE)){
+    busyUntil = millis() + MOCK_CMD_MS;
+  }
+}
+
+boolean Evebrain::segmentDone(uint16_t seq){
+  return (int16_t)(seq - doneSeq) <= 0;
+}
+
+boolean Evebrain::ready(){
+  return queuedSeq == doneSeq && (long)(millis() - busyUntil) >= 0;
+}
+
+boolean Evebrain::idle(){
+  return ready() && !cmdProcessor.in_process;
+}
+
+unsigned long Evebrain::nextEvent(){
+  if(queuedSeq != doneSeq) return segmentEnd[(uint16_t)(doneSeq + 1) % MOCK_SEGMENTS];
+  return (long)(millis() - busyUntil) < 0 ? busyUntil : millis();
+}
+
+void Evebrain::checkReady(){
+  uint16_t segment;
+  while(queuedSeq != doneSeq && segmentEnd[(uint16_t)(doneSeq + 1) % MOCK_SEGMENTS] <= millis()){
+    doneSeq++;
+  }
+  while(cmdProcessor.currentTag(segment) && segmentDone(segment)){
+    cmdProcessor.sendComplete();
+  }
+  if(cmdProcessor.in_process && ready()){
+    cmdProcessor.sendComplete();
+  }
+  cmdProcessor.processQueue();
+}
@@ -0,0 +1,52 @@
+#ifndef __Evebrain_h__
+#define __Evebrain_h__
+
+// Stands in for the robot when CmdProcessor is built on a PC. It has a
+// handler for every command in the real table, which build.sh pulls out of
+// src/Evebrain.cpp into cmds.inc, one CMD_ROW(name, handler, flags, opcode)
+// a line. The handlers don't touch any hardware, they only take as long as
+// the real ones would to complete.
+
+#include "Arduino.h"
+#include "lib/CmdProcessor.h"
+
+// How long a streamed move takes for each unit of its arg (mm or degrees),
+// and how long one with an object arg or any other slow command takes
+#define MOCK_MS_PER_UNIT 10
+#define MOCK_CMD_MS 100
+// Moves that can be handed to the motors at once, as SEGMENT_BUFFER_LENGTH
+#define MOCK_SEGMENTS 8
+
+class Evebrain {
+  public:
+    Evebrain();
+    // Hands the table to cmdProcessor, as Evebrain::initCmds does
+    void initCmds();
+#define CMD_ROW(name, fn, flags, opcode) void fn(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson);
+#include "cmds.inc"
+#undef CMD_ROW
+    // Completes commands that have finished and starts the next one that's
+    // queued, as Evebrain::checkReady does on every pass of loop()
+    void checkReady();
+    // The command table, for the lookup bench
+    static const Cmd cmds[];
+    static const int cmdCount;
+    // Nothing is moving, in progress or queued
+    boolean idle();
+    // When the next move or slow command finishes, or now if none is going
+    unsigned long nextEvent();
+  private:
+    void run(const char *cmd, uint8_t flags, ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson);
+    boolean ready();
+    boolean segmentDone(uint16_t seq);
+    // When each move handed to the motors finishes, by sequence number
+    unsigned long segmentEnd[MOCK_SEGMENTS];
+    uint16_t queuedSeq;
+    uint16_t doneSeq;
+    // When the slow command in progress, if any, finishes
+    unsigned long busyUntil;
+};
+
+extern CmdProcessor cmdProcessor;
+
+#endif
@@ -0,0 +1,78 @@
+// Just enough of the ESP8266 Arduino core for ShiftStepper and CmdProcessor to
+// build on a PC. The timer, shift register and cycle counter are recorded for
+// the benches, and each bench keeps its own clock.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+#define B0000 0
+#define B0001 1
+#define B0010 2
+#define B0011 3
+#define B0100 4
+#define B0110 6
+#define B1000 8
+#define B1001 9
+#define B1100 12
+#define B1111 15
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define MSBFIRST 1
+#define ICACHE_RAM_ATTR
+#define TIM_DIV1 0
+#define TIM_EDGE 0
+#define TIM_SINGLE 0
+#define TIM_LOOP 1
+#define clockCyclesPerMicrosecond() 80
+// Nothing interrupts the bench, so atomic blocks just run once
+#define ATOMIC() for(int _atomic = 1; _atomic; _atomic = 0)
+
+typedef void (*timercallback)(void);
+void timer1_disable();
+void timer1_isr_init();
+void timer1_attachInterrupt(timercallback);
+void timer1_enable(uint8_t, uint8_t, uint8_t);
+void timer1_write(uint32_t);
+void pinMode(uint8_t, uint8_t);
+void digitalWrite(uint8_t, uint8_t);
+void shiftOut(uint8_t, uint8_t, uint8_t, uint8_t);
+
+extern volatile uint32_t GPOS, GPOC, SPI1W0, SPI1CMD, SPI1U1;
+#define SPIBUSY (1 << 18)
+#define SPILMOSI 17
+#define SPIMMOSI 0x1FF
+
+class EspClass {
+  public:
+    uint32_t getCycleCount();
+};
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+
+// Flash is ordinary memory on the PC
+#define PROGMEM
+#define F(s) (s)
+#define strcpy_P strcpy
+#define strcmp_P strcmp
+#define memcpy_P memcpy
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+
+// Anything the code under test prints goes to stderr, out of the way of the
+// bench's own output
+class HardwareSerial {
+  public:
+    void print(const char *s) { fputs(s, stderr); }
+    void print(long n) { fprintf(stderr, "%ld", n); }
+    void println(const char *s) { fprintf(stderr, "%s\n", s); }
+    void println(long n) { fprintf(stderr, "%ld\n", n); }
+};
+extern HardwareSerial Serial;
@@ -0,0 +1,3 @@
+#pragma once
+// Without ARDUINO defined, ArduinoJson brings its own copy of Print
+#include "lib/ArduinoJson/ArduinoJson/Arduino/Print.hpp"
@@ -0,0 +1,12 @@
+#pragma once
+#include "Arduino.h"
+#define SPI_MODE0 0
+class SPIClass {
+  public:
+    void begin() {}
+    void setHwCs(bool) {}
+    void setFrequency(uint32_t) {}
+    void setDataMode(uint8_t) {}
+    void setBitOrder(uint8_t) {}
+};
+extern SPIClass SPI;
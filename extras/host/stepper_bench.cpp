@@ -0,0 +1,276 @@
+// Runs ShiftStepper off the board, calling the timer interrupt directly, to
+// check step timing and compare interrupt costs between changes.
+//
+//   stepper_bench mixed [trace]            200 mixed moves: the interrupts
+//                                          taken and host cycles spent in
+//                                          them, with every shift register
+//                                          write saved to the trace file
+//   stepper_bench move accel steps [speed] one move of both motors: how long
+//                                          it takes and the gaps between steps
+//   stepper_bench dump trace               prints a trace, one write a line
+//   stepper_bench slack                    checks the slack taken up after
+//                                          moves are stopped part way
+//
+// accel is in steps/s^2 (the default 200mm/s^2 is about 3200). Cycle counts
+// are from the PC, so only compare them with each other.
+//
+// A trace starts with "SST1" and the tick length in us (one byte). Then each
+// write is the ticks since the write before, as a LEB128 varint, followed by
+// the byte written to the shift register.
+#include "Arduino.h"
+#include <SPI.h>
+#include "lib/ShiftStepper.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HOST_CYCLES() __rdtsc()
+#else
+#define HOST_CYCLES() 0ULL
+#endif
+
+EspClass ESP;
+SPIClass SPI;
+volatile uint32_t GPOS, GPOC, SPI1W0, SPI1CMD, SPI1U1;
+
+// Simulated time, in 50us ticks
+static uint64_t ticks = 0;
+static uint32_t timerCycles = 0;
+static long shiftWrites = 0;
+static FILE *trace = NULL;
+static uint64_t lastWrite = 0;
+
+static void traceWrite(uint8_t bits){
+  if(!trace) return;
+  uint64_t delta = ticks - lastWrite;
+  lastWrite = ticks;
+  do{
+    fputc((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0), trace);
+    delta >>= 7;
+  }while(delta);
+  fputc(bits, trace);
+}
+
+uint32_t EspClass::getCycleCount(){ return ticks * BASE_INTERRUPT_US * clockCyclesPerMicrosecond(); }
+void timer1_disable(){}
+void timer1_isr_init(){}
+void timer1_attachInterrupt(timercallback){}
+void timer1_enable(uint8_t, uint8_t, uint8_t){}
+void timer1_write(uint32_t cycles){ timerCycles = cycles; }
+void pinMode(uint8_t, uint8_t){}
+void digitalWrite(uint8_t, uint8_t){}
+void shiftOut(uint8_t, uint8_t, uint8_t, uint8_t bits){ shiftWrites++; traceWrite(bits); }
+
+ShiftStepper rightMotor(5);
+ShiftStepper leftMotor(1);
+
+// Moves time on to the interrupt the timer was set for, and takes it
+static uint64_t interrupt(){
+  ticks += timerCycles / (BASE_INTERRUPT_US * clockCyclesPerMicrosecond());
+  uint64_t start = HOST_CYCLES();
+  ShiftStepper::triggerTop();
+  return HOST_CYCLES() - start;
+}
+
+static boolean done(){
+  return rightMotor.ready() && leftMotor.ready();
+}
+
+static int mixed(const char *path){
+  if(path){
+    trace = fopen(path, "wb");
+    if(!trace){
+      perror(path);
+      return 1;
+    }
+    fputs("SST1", trace);
+    fputc(BASE_INTERRUPT_US, trace);
+  }
+  ShiftStepper::setAcceleration(2000);
+  uint64_t cycles = 0, interrupts = 0;
+  for(int i = 0; i < 200; i++){
+    rightMotor.setRelSpeed(i % 3 == 0 ? 0.5 : 1);
+    rightMotor.plan(2000 + i, i & 1);
+    leftMotor.plan(1500 - i, !(i & 1));
+    ShiftStepper::queuePlanned();
+    if(i % 2){
+      rightMotor.plan(300, i & 1);
+      leftMotor.plan(300, !(i & 1));
+      ShiftStepper::queuePlanned();
+    }
+    while(!done()){
+      cycles += interrupt();
+      interrupts++;
+    }
+  }
+  if(trace && fclose(trace)){
+    perror(path);
+    return 1;
+  }
+  printf("writes %ld ticks %llu interrupts %llu cycles/interrupt %.1f\n",
+         shiftWrites, (unsigned long long)ticks,
+         (unsigned long long)interrupts, interrupts ? (double)cycles / interrupts : 0.0);
+  return 0;
+}
+
+static int dump(const char *path){
+  FILE *f = fopen(path, "rb");
+  char magic[4];
+  if(!f || fread(magic, 1, 4, f) != 4 || memcmp(magic, "SST1", 4)){
+    fprintf(stderr, "%s: not a trace\n", path);
+    return 1;
+  }
+  int tickUs = fgetc(f);
+  uint64_t at = 0;
+  for(;;){
+    uint64_t delta = 0;
+    int c, shift = 0;
+    do{
+      c = fgetc(f);
+      if(c == EOF) break;
+      delta |= (uint64_t)(c & 0x7F) << shift;
+      shift += 7;
+    }while(c & 0x80);
+    int bits = c == EOF ? EOF : fgetc(f);
+    if(bits == EOF) break;
+    at += delta;
+    printf("%llu %02x\n", (unsigned long long)(at * tickUs), bits);
+  }
+  fclose(f);
+  return 0;
+}
+
+static int move(float accel, long steps, float speed){
+  ShiftStepper::setAcceleration(accel);
+  if(speed < 1){
+    rightMotor.setRelSpeed(speed);
+    leftMotor.setRelSpeed(speed);
+  }
+  rightMotor.plan(steps, FORWARD);
+  leftMotor.plan(steps, BACKWARD);
+  ShiftStepper::queuePlanned();
+  uint32_t taken = 0;
+  uint64_t lastStep = 0, minGap = ~0ULL, maxGap = 0;
+  while(!done()){
+    interrupt();
+    if(rightMotor.steps() != taken){
+      if(taken){
+        uint64_t gap = ticks - lastStep;
+        if(gap < minGap) minGap = gap;
+        if(gap > maxGap) maxGap = gap;
+      }
+      taken = rightMotor.steps();
+      lastStep = ticks;
+    }
+  }
+  printf("steps %u time %.3fs step gaps %lluus to %lluus\n", taken,
+         ticks * BASE_INTERRUPT_US / 1e6,
+         (unsigned long long)(minGap * BASE_INTERRUPT_US), (unsigned long long)(maxGap * BASE_INTERRUPT_US));
+  return 0;
+}
+
+#define SLACK 14
+
+// Steps the right motor has taken without moving the wheel
+static uint32_t slackTaken = 0;
+
+// Runs until the right motor has taken this many steps (slack included), or
+// until everything has finished when steps is 0
+static void runSteps(uint32_t steps){
+  uint32_t start = rightMotor.steps();
+  while(!done() && (!steps || rightMotor.steps() - start < steps)){
+    uint32_t taken = rightMotor.steps();
+    long position = rightMotor.position();
+    interrupt();
+    // there's at most one step an interrupt
+    if(rightMotor.steps() != taken && rightMotor.position() == position){
+      slackTaken++;
+    }
+  }
+}
+
+// Queues a move of both motors, the right one going this way
+static void queue(long steps, byte dir){
+  rightMotor.plan(steps, dir);
+  leftMotor.plan(steps, !dir);
+  ShiftStepper::queuePlanned();
+}
+
+// Drives both motors, the right one going this way
+static void drive(long steps, byte dir){
+  rightMotor.plan(steps, dir);
+  leftMotor.plan(steps, !dir);
+  ShiftStepper::drivePlanned();
+}
+
+static void stop(){
+  rightMotor.stop();
+  leftMotor.stop();
+}
+
+// Checks the slack a 100 step move this way takes up
+static int expectSlack(const char *name, byte dir, unsigned int slack){
+  slackTaken = 0;
+  queue(100, dir);
+  runSteps(0);
+  printf("%s: %u slack steps, expected %u\n", name, slackTaken, slack);
+  return slackTaken == slack ? 0 : 1;
+}
+
+static int slack(){
+  ShiftStepper::setAcceleration(2000);
+  ShiftStepper::setSlack(SLACK);
+  int failed = 0;
+  queue(100, FORWARD);
+  runSteps(0);
+
+  // stopped while still going forward, with a reversal queued
+  queue(2000, FORWARD);
+  queue(2000, BACKWARD);
+  runSteps(49);
+  stop();
+  failed += expectSlack("reversal dropped, going back", BACKWARD, SLACK);
+
+  // stopped 5 steps into taking up the slack going forward
+  queue(2000, FORWARD);
+  runSteps(5);
+  stop();
+  failed += expectSlack("slack cut short, carrying on", FORWARD, SLACK - 5);
+
+  queue(2000, BACKWARD);
+  runSteps(5);
+  stop();
+  failed += expectSlack("slack cut short, going back", FORWARD, 5);
+
+  // a drive that reverses, sent again while the motors are still slowing down
+  queue(100, FORWARD);
+  runSteps(0);
+  drive(4000, FORWARD);
+  runSteps(200);
+  drive(4000, BACKWARD);
+  runSteps(5);
+  drive(4000, BACKWARD);
+  slackTaken = 0;
+  runSteps(0);
+  printf("drive reversal sent twice: %u slack steps, expected %u\n", slackTaken, SLACK);
+  failed += slackTaken != SLACK;
+
+  printf(failed ? "FAIL\n" : "OK\n");
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv){
+  ShiftStepper::setup(12, 13, 14);
+  if(argc >= 2 && !strcmp(argv[1], "mixed")){
+    return mixed(argc > 2 ? argv[2] : NULL);
+  }
+  if(argc >= 2 && !strcmp(argv[1], "slack")){
+    return slack();
+  }
+  if(argc >= 3 && !strcmp(argv[1], "dump")){
+    return dump(argv[2]);
+  }
+  if(argc >= 4 && !strcmp(argv[1], "move")){
+    return move(atof(argv[2]), atol(argv[3]), argc > 4 ? atof(argv[4]) : 1);
+  }
+  fprintf(stderr, "usage: %s mixed [trace] | move accel steps [speed] | dump trace | slack\n", argv[0]);
+  return 1;
+}
@@ -34,13 +34,17 @@ void handleWsMsg(char * msg){
   cmdProcessor.processMsg(msg);
 }
 
-void sendSerialMsg(ArduinoJson::JsonObject &outMsg){
-  outMsg.printTo(Serial);
+void handleWsBinaryMsg(const uint8_t * msg, size_t len){
+  cmdProcessor.processBinaryMsg(msg, len);
+}
+
+void sendSerialMsg(const char *msg, size_t len){
+  Serial.write(msg, len);
   Serial.println();
 }
 
-void sendSerialMsgV1(ArduinoJson::JsonObject &outMsg){
-  v1ws.send(outMsg);
+void sendSerialMsgV1(const char *msg, size_t len){
+  v1ws.send(msg, len);
 }
 
 Evebrain::Evebrain(){
@@ -48,6 +52,13 @@ Evebrain::Evebrain(){
   nextADCRead = 0;
   lastLedChange = millis();
   calibratingSlack = false;
+  driving = false;
+  poseInterval = 0;
+  lastPoseNotify = 0;
+  poseChanged = false;
+  lastPoll = 0;
+  maxPollGap = 0;
+  resetPose();
   timeTillComplete = 0;
   humidityRead = 0;
   humidityVar = 0;
@@ -63,6 +74,7 @@ Evebrain::Evebrain(){
   servoPosition = 0;
   buzzerBeep = 0;
   wifiEnabled = false;
+  serial_binary = false;
 }
 void Evebrain::begin(unsigned char v){
   version(v);
@@ -113,6 +125,7 @@ void Evebrain::enableSerial(){
 void Evebrain::enableWifi(){
   wifi.begin(&settings);
   wifi.onMsg(handleWsMsg);
+  wifi.onBinaryMsg(handleWsBinaryMsg);
   cmdProcessor.addOutputHandler(wifi.sendWebSocketMsg);
   wifiEnabled = true;
 }
@@ -120,6 +133,8 @@ void Evebrain::enableWifi(){
 void Evebrain::calculateForWheels() {
   steps_per_mm = STEPS_PER_TURN / (PI * settings.wheelDiameter);
   steps_per_degree = ((settings.wheelDistance * PI) / 360) * steps_per_mm;
+  ShiftStepper::setAcceleration(settings.acceleration * steps_per_mm);
+  ShiftStepper::setSlack(settings.slackCalibration);
 }
 
 void Evebrain::initSettings(){
@@ -135,6 +150,17 @@ void Evebrain::initSettings(){
        settings.moveCalibration < 1.5f &&
        settings.turnCalibration > 0.5f &&
        settings.turnCalibration < 1.5f){
+      // Added to the end of the settings without changing the version, so
+      // it's whatever was in the EEPROM after the older settings
+      if (!(settings.acceleration >= 0 && settings.acceleration <= MAX_ACCELERATION)) {
+        settings.acceleration = DEFAULT_ACCELERATION;
+      }
+      if (!(settings.driveTimeout >= MIN_DRIVE_TIMEOUT && settings.driveTimeout <= MAX_DRIVE_TIMEOUT)) {
+        settings.driveTimeout = DEFAULT_DRIVE_TIMEOUT;
+      }
+      if (!PinServos::holdValid(settings.servoHold)) {
+        settings.servoHold = DEFAULT_SERVO_HOLD;
+      }
       // The values look OK so let's leave them as they are
       if (digitalRead(RESET) == 0) {
         calculateForWheels();
@@ -149,6 +175,9 @@ void Evebrain::initSettings(){
   settings.turnCalibration = 1.0f;
   settings.wheelDiameter = DEFAULT_DIAMETER_MM_V2;
   settings.wheelDistance = DEFAULT_WHEEL_DISTANCE_V2;
+  settings.acceleration = DEFAULT_ACCELERATION;
+  settings.driveTimeout = DEFAULT_DRIVE_TIMEOUT;
+  settings.servoHold = DEFAULT_SERVO_HOLD;
   calculateForWheels();
   settings.sta_ssid[0] = 0;
   settings.sta_pass[0] = 0;
@@ -188,55 +217,68 @@ void Evebrain::hmc5883l_init(){   /* Magneto initialize function */
   Wire.endTransmission();
 }
 
+// The command table lives in flash and must be kept sorted by command name
+// (strcmp order) so that CmdProcessor can binary search it.
+const Cmd Evebrain::cmds[] PROGMEM = {
+  // Command name      Handler function               Flags                         Opcode
+  {"analogInput",      &Evebrain::_analogInput,       CMD_IMMEDIATE,                18},
+  {"arc",              &Evebrain::_arc,               CMD_STREAM,                   49},
+  {"back",             &Evebrain::_back,              CMD_STREAM,                   13},
+  {"beep",             &Evebrain::_beep,              0,                            16},
+  {"calibrateMove",    &Evebrain::_calibrateMove,     CMD_IMMEDIATE,                10},
+  {"calibrateSlack",   &Evebrain::_calibrateSlack,    0,                            17},
+  {"calibrateTurn",    &Evebrain::_calibrateTurn,     CMD_IMMEDIATE,                11},
+  {"compassSensor",    &Evebrain::_compassSensor,     0,                            31},
+  {"digitalInput",     &Evebrain::_digitalInput,      CMD_IMMEDIATE,                20},
+  {"digitalNotify",    &Evebrain::_digitalNotify,     CMD_IMMEDIATE,                21},
+  {"digitalStopNotify",&Evebrain::_digitalStopNotify, CMD_IMMEDIATE,                22},
+  {"distanceSensor",   &Evebrain::_distanceSensor,    0,                            30},
+  {"drive",            &Evebrain::_drive,             CMD_IMMEDIATE | CMD_NOCACHE,  50},
+  {"forward",          &Evebrain::_forward,           CMD_STREAM,                   12},
+  {"freeHeap",         &Evebrain::_freeHeap,          CMD_IMMEDIATE,                45},
+  {"freeStack",        &Evebrain::_freeStack,         CMD_IMMEDIATE,                47},
+  {"getConfig",        &Evebrain::_getConfig,         CMD_IMMEDIATE,                42},
+  {"goto",             &Evebrain::_goTo,              0,                            52},
+  {"gpio_off",         &Evebrain::_gpio_off,          CMD_IMMEDIATE,                24},
+  {"gpio_on",          &Evebrain::_gpio_on,           CMD_IMMEDIATE,                23},
+  {"gpio_pwm_10",      &Evebrain::_gpio_pwm_10,       CMD_IMMEDIATE,                27},
+  {"gpio_pwm_16",      &Evebrain::_gpio_pwm_16,       CMD_IMMEDIATE,                25},
+  {"gpio_pwm_5",       &Evebrain::_gpio_pwm_5,        CMD_IMMEDIATE,                26},
+  {"humidity",         &Evebrain::_humidity,          0,                            29},
+  {"left",             &Evebrain::_left,              CMD_STREAM,                   15},
+  {"leftMotorB",       &Evebrain::_leftMotorBackward, CMD_STREAM,                   34},
+  {"leftMotorF",       &Evebrain::_leftMotorForward,  CMD_STREAM,                   33},
+  {"moveCalibration",  &Evebrain::_moveCalibration,   CMD_IMMEDIATE,                8},
+  {"pause",            &Evebrain::_pause,             CMD_IMMEDIATE | CMD_PRIORITY, 4},
+  {"pinServo",         &Evebrain::_pinServo,          CMD_IMMEDIATE,                41},
+  {"ping",             &Evebrain::_ping,              CMD_IMMEDIATE,                2},
+  {"pose",             &Evebrain::_pose,              CMD_IMMEDIATE,                51},
+  {"postToServer",     &Evebrain::_postToServer,      0,                            32},
+  {"readSensors",      &Evebrain::_readSensors,       0,                            19},
+  {"resetConfig",      &Evebrain::_resetConfig,       CMD_IMMEDIATE,                44},
+  {"resume",           &Evebrain::_resume,            CMD_IMMEDIATE | CMD_PRIORITY, 5},
+  {"right",            &Evebrain::_right,             CMD_STREAM,                   14},
+  {"rightMotorB",      &Evebrain::_rightMotorBackward, CMD_STREAM,                   36},
+  {"rightMotorF",      &Evebrain::_rightMotorForward, CMD_STREAM,                   35},
+  {"servo",            &Evebrain::_servo,             0,                            39},
+  {"servoII",          &Evebrain::_servoII,           0,                            40},
+  {"setConfig",        &Evebrain::_setConfig,         CMD_IMMEDIATE,                43},
+  {"slackCalibration", &Evebrain::_slackCalibration,  CMD_IMMEDIATE,                7},
+  {"speedMove",        &Evebrain::_speedMove,         CMD_STREAM,                   37},
+  {"speedMoveSteps",   &Evebrain::_speedMoveSteps,    CMD_STREAM,                   38},
+  {"startWifiScan",    &Evebrain::_startWifiScan,     CMD_IMMEDIATE,                46},
+  {"stats",            &Evebrain::_stats,             CMD_IMMEDIATE,                48},
+  {"stepperStats",     &Evebrain::_stepperStats,      CMD_IMMEDIATE,                53},
+  {"stop",             &Evebrain::_stop,              CMD_IMMEDIATE | CMD_PRIORITY, 6},
+  {"temperature",      &Evebrain::_temperature,       0,                            28},
+  {"turnCalibration",  &Evebrain::_turnCalibration,   CMD_IMMEDIATE,                9},
+  {"uptime",           &Evebrain::_uptime,            CMD_IMMEDIATE,                3},
+  {"version",          &Evebrain::_version,           CMD_IMMEDIATE,                1},
+};
+
 void ICACHE_FLASH_ATTR Evebrain::initCmds(){
   cmdProcessor.setEvebrain(self());
-  //             Command name        Handler function             // Returns immediately
-  cmdProcessor.addCmd("version",          &Evebrain::_version,          true);
-  cmdProcessor.addCmd("ping",             &Evebrain::_ping,             true);
-  cmdProcessor.addCmd("uptime",           &Evebrain::_uptime,           true);
-  cmdProcessor.addCmd("pause",            &Evebrain::_pause,            true);
-  cmdProcessor.addCmd("resume",           &Evebrain::_resume,           true);
-  cmdProcessor.addCmd("stop",             &Evebrain::_stop,             true);
-  cmdProcessor.addCmd("slackCalibration", &Evebrain::_slackCalibration, true);
-  cmdProcessor.addCmd("moveCalibration",  &Evebrain::_moveCalibration,  true);
-  cmdProcessor.addCmd("turnCalibration",  &Evebrain::_turnCalibration,  true);
-  cmdProcessor.addCmd("calibrateMove",    &Evebrain::_calibrateMove,    true);
-  cmdProcessor.addCmd("calibrateTurn",    &Evebrain::_calibrateTurn,    true);
-  cmdProcessor.addCmd("forward",          &Evebrain::_forward,          false);
-  cmdProcessor.addCmd("back",             &Evebrain::_back,             false);
-  cmdProcessor.addCmd("right",            &Evebrain::_right,            false);
-  cmdProcessor.addCmd("left",             &Evebrain::_left,             false);
-  cmdProcessor.addCmd("beep",             &Evebrain::_beep,             false);
-  cmdProcessor.addCmd("calibrateSlack",   &Evebrain::_calibrateSlack,   false);
-  cmdProcessor.addCmd("analogInput",      &Evebrain::_analogInput,      true);
-  cmdProcessor.addCmd("readSensors",      &Evebrain::_readSensors,      false);
-  cmdProcessor.addCmd("digitalInput",     &Evebrain::_digitalInput,     true);
-  cmdProcessor.addCmd("digitalNotify",    &Evebrain::_digitalNotify,    true);
-  cmdProcessor.addCmd("digitalStopNotify",&Evebrain::_digitalStopNotify,true);
-  cmdProcessor.addCmd("gpio_on",          &Evebrain::_gpio_on,          true);
-  cmdProcessor.addCmd("gpio_off",         &Evebrain::_gpio_off,         true);
-  cmdProcessor.addCmd("gpio_pwm_16",      &Evebrain::_gpio_pwm_16,      true);
-  cmdProcessor.addCmd("gpio_pwm_5",       &Evebrain::_gpio_pwm_5,       true);
-  cmdProcessor.addCmd("gpio_pwm_10",      &Evebrain::_gpio_pwm_10,      true);
-  cmdProcessor.addCmd("temperature",      &Evebrain::_temperature,      false);
-  cmdProcessor.addCmd("humidity",         &Evebrain::_humidity,         false);
-  cmdProcessor.addCmd("distanceSensor",   &Evebrain::_distanceSensor,   false);
-  cmdProcessor.addCmd("compassSensor",    &Evebrain::_compassSensor,    false);
-  cmdProcessor.addCmd("postToServer",     &Evebrain::_postToServer,     false);
-  cmdProcessor.addCmd("leftMotorF",       &Evebrain::_leftMotorForward, false);
-  cmdProcessor.addCmd("leftMotorB",       &Evebrain::_leftMotorBackward,false);
-  cmdProcessor.addCmd("rightMotorF",      &Evebrain::_rightMotorForward,false);
-  cmdProcessor.addCmd("rightMotorB",      &Evebrain::_rightMotorBackward,false);
-  cmdProcessor.addCmd("speedMove",        &Evebrain::_speedMove,        false);
-  cmdProcessor.addCmd("speedMoveSteps",   &Evebrain::_speedMoveSteps,   false);
-  cmdProcessor.addCmd("servo",            &Evebrain::_servo,            false);
-  cmdProcessor.addCmd("servoII",          &Evebrain::_servoII,          false);
-  cmdProcessor.addCmd("pinServo",         &Evebrain::_pinServo,          true);
-  cmdProcessor.addCmd("getConfig",        &Evebrain::_getConfig,        true);
-  cmdProcessor.addCmd("setConfig",        &Evebrain::_setConfig,        true);
-  cmdProcessor.addCmd("resetConfig",      &Evebrain::_resetConfig,      true);
-  cmdProcessor.addCmd("freeHeap",         &Evebrain::_freeHeap,         true);
-  cmdProcessor.addCmd("startWifiScan",    &Evebrain::_startWifiScan,    true);
+  cmdProcessor.setCmds(cmds, sizeof(cmds) / sizeof(cmds[0]));
 }
 
 void Evebrain::_version(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
@@ -262,6 +304,7 @@ void Evebrain::_resume(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject
 }
 
 void Evebrain::_stop(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
+  cmdProcessor.cancelQueue();
   stop();
 }
 
@@ -286,36 +329,42 @@ void Evebrain::_calibrateTurn(ArduinoJson::JsonObject &inJson, ArduinoJson::Json
   calibrateTurn(atof(inJson["arg"].asString()));
 }
 
+// For moves that can't be queued, as the motors' segment buffer is full
+static void segmentBufferFull(ArduinoJson::JsonObject &outJson){
+  outJson["status"] = "error";
+  outJson["msg"] = "Too many moves queued";
+}
+
 void Evebrain::_forward(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  forward(atoi(inJson["arg"].asString()));
+  if(!forward(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_back(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  back(atoi(inJson["arg"].asString()));
+  if(!back(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_right(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  right(atoi(inJson["arg"].asString()));
+  if(!right(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_left(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  left(atoi(inJson["arg"].asString()));
+  if(!left(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_leftMotorForward(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  leftMotorForward(atoi(inJson["arg"].asString()));
+  if(!leftMotorForward(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_rightMotorForward(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  rightMotorForward(atoi(inJson["arg"].asString()));
+  if(!rightMotorForward(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_leftMotorBackward(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  leftMotorBackward(atoi(inJson["arg"].asString()));
+  if(!leftMotorBackward(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_rightMotorBackward(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
-  rightMotorBackward(atoi(inJson["arg"].asString()));
+  if(!rightMotorBackward(atoi(inJson["arg"].asString()))) segmentBufferFull(outJson);
 }
 
 void Evebrain::_speedMove(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson) {
@@ -349,7 +398,97 @@ void Evebrain::_speedMove(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObje
     rightSpeed = 0.1;
   }
 
-  speedMove(leftDistance, leftSpeed, rightDistance, rightSpeed);
+  if(!speedMove(leftDistance, leftSpeed, rightDistance, rightSpeed)) segmentBufferFull(outJson);
+}
+
+void Evebrain::_arc(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson) {
+  float radius = inJson["arg"]["radius"], angle = inJson["arg"]["angle"];
+  float speed = inJson["arg"].asObject().containsKey("speed") ? inJson["arg"]["speed"] : 1.0;
+  if (radius < 0.0) {
+    outJson["status"] = "error";
+    outJson["msg"] = "Radius is out of range, cannot be negative";
+    return;
+  }
+  if (speed <= 0.0 || speed > 1.0) {
+    outJson["status"] = "error";
+    outJson["msg"] = "Speed is out of range, must be within (0,1]";
+    return;
+  }
+  // make sure speed is not too low.
+  if (speed < 0.1) {
+    speed = 0.1;
+  }
+
+  if(!arc(radius, angle, speed)) segmentBufferFull(outJson);
+}
+
+void Evebrain::_drive(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson) {
+  float leftSpeed = inJson["arg"]["leftSpeed"], rightSpeed = inJson["arg"]["rightSpeed"];
+  if (leftSpeed < -1.0 || leftSpeed > 1.0) {
+    outJson["status"] = "error";
+    outJson["msg"] = "Left speed is out of range, must be within [-1,1]";
+    return;
+  }
+  if (rightSpeed < -1.0 || rightSpeed > 1.0) {
+    outJson["status"] = "error";
+    outJson["msg"] = "Right speed is out of range, must be within [-1,1]";
+    return;
+  }
+
+  drive(leftSpeed, rightSpeed);
+}
+
+void Evebrain::_goTo(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson) {
+  if (!(inJson["arg"].is<JsonObject&>() && inJson["arg"].asObject().containsKey("x") &&
+        inJson["arg"].asObject().containsKey("y"))) {
+    outJson["status"] = "error";
+    outJson["msg"] = "Target is missing, needs x and y";
+    return;
+  }
+  float x = inJson["arg"]["x"], y = inJson["arg"]["y"];
+  float heading = inJson["arg"].asObject().containsKey("heading") ? inJson["arg"]["heading"] : NAN;
+  float speed = inJson["arg"].asObject().containsKey("speed") ? inJson["arg"]["speed"] : 1.0;
+  if (speed <= 0.0 || speed > 1.0) {
+    outJson["status"] = "error";
+    outJson["msg"] = "Speed is out of range, must be within (0,1]";
+    return;
+  }
+  // make sure speed is not too low.
+  if (speed < 0.1) {
+    speed = 0.1;
+  }
+
+  if (driving) {
+    // the wheels are still going, so the pose is already out of date
+    outJson["status"] = "error";
+    outJson["msg"] = "Can't goto while driving, stop first";
+    return;
+  }
+
+  if(!goTo(x, y, heading, speed)) segmentBufferFull(outJson);
+}
+
+void Evebrain::_pose(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson) {
+  if (inJson["arg"].is<JsonObject&>()) {
+    if (inJson["arg"]["reset"]) {
+      resetPose();
+    }
+    // Notify the pose this often while it changes, in ms (0 to stop)
+    if (inJson["arg"].asObject().containsKey("interval")) {
+      unsigned int interval = inJson["arg"]["interval"];
+      if (interval && interval < MIN_POSE_INTERVAL) {
+        outJson["status"] = "error";
+        outJson["msg"] = "Interval is out of range, must be 0 or at least 20";
+        return;
+      }
+      poseInterval = interval;
+    }
+  }
+  updatePose();
+  JsonObject& msg = outJson.createNestedObject("msg");
+  msg["x"] = poseX;
+  msg["y"] = poseY;
+  msg["angle"] = poseAngle;
 }
 
 void Evebrain::_speedMoveSteps(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson) {
@@ -383,7 +522,7 @@ void Evebrain::_speedMoveSteps(ArduinoJson::JsonObject &inJson, ArduinoJson::Jso
     rightSpeed = 0.1;
   }
 
-  speedMoveSteps(leftSteps, leftSpeed, rightSteps, rightSpeed);
+  if(!speedMoveSteps(leftSteps, leftSpeed, rightSteps, rightSpeed)) segmentBufferFull(outJson);
 }
 
 void Evebrain::_servo(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
@@ -398,7 +537,17 @@ void Evebrain::_pinServo(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObjec
   const char* pin = inJson["arg"]["pin"].asString();
   const char* angle = inJson["arg"]["angle"].asString();
   if (pin && angle) {
-    int success = PinServos::startServo(atoi(angle), atoi(pin));
+    // the hold time can be given for just this servo, otherwise it's the setting
+    long hold = settings.servoHold;
+    if (inJson["arg"].asObject().containsKey("hold")) {
+      hold = inJson["arg"]["hold"].as<long>();
+      if (!PinServos::holdValid(hold)) {
+        outJson["status"] = "error";
+        outJson["msg"] = "Hold is out of range, must be within [100,60000]";
+        return;
+      }
+    }
+    int success = PinServos::startServo(atoi(angle), atoi(pin), hold);
     if (!success) {
       outJson["status"] = "error";
       outJson["msg"] = "Pin not valid for generic servo.";  
@@ -535,6 +684,9 @@ void Evebrain::_getConfig(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObje
   msg["wheelDiameter"] = settings.wheelDiameter;
   msg["wheelDistance"] = settings.wheelDistance;
   msg["stepsPerTurn"] = STEPS_PER_TURN;
+  msg["acceleration"] = settings.acceleration;
+  msg["driveTimeout"] = settings.driveTimeout;
+  msg["servoHold"] = settings.servoHold;
 }
 
 void Evebrain::_setConfig(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
@@ -598,6 +750,27 @@ void Evebrain::_setConfig(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObje
   if (inJson["arg"].asObject().containsKey("wheelDistance")) {
     settings.wheelDistance = inJson["arg"]["wheelDistance"];
   }
+  // How quickly the wheels speed up and slow down, in mm/s^2 (0 for no ramp)
+  if (inJson["arg"].asObject().containsKey("acceleration")) {
+    float accel = inJson["arg"]["acceleration"];
+    if (accel >= 0 && accel <= MAX_ACCELERATION) {
+      settings.acceleration = accel;
+    }
+  }
+  // How long drive keeps going without hearing from the client, in ms
+  if (inJson["arg"].asObject().containsKey("driveTimeout")) {
+    unsigned int timeout = inJson["arg"]["driveTimeout"];
+    if (timeout >= MIN_DRIVE_TIMEOUT && timeout <= MAX_DRIVE_TIMEOUT) {
+      settings.driveTimeout = timeout;
+    }
+  }
+  // How long pinServo holds a servo at its angle, in ms
+  if (inJson["arg"].asObject().containsKey("servoHold")) {
+    long hold = inJson["arg"]["servoHold"].as<long>();
+    if (PinServos::holdValid(hold)) {
+      settings.servoHold = hold;
+    }
+  }
   calculateForWheels();
   wifi.setupWifi();
   saveSettings();
@@ -611,58 +784,98 @@ void Evebrain::_resetConfig(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonOb
 void Evebrain::_freeHeap(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
   outJson["msg"] = ESP.getFreeHeap();
 }
+void Evebrain::_freeStack(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
+  // The least free stack there has been since boot
+  outJson["msg"] = ESP.getFreeContStack();
+}
 void Evebrain::_startWifiScan(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
   EvebrainWifi::startWifiScan();
 }
+void Evebrain::_stepperStats(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
+  StepperStats st;
+  ShiftStepper::getStats(st);
+  JsonObject& msg = outJson.createNestedObject("msg");
+  msg["interrupts"] = st.interrupts;
+  msg["maxCycles"] = st.maxCycles;
+  msg["avgCycles"] = st.interrupts ? (uint32_t)(st.totalCycles / st.interrupts) : 0;
+  msg["overruns"] = st.overruns;
+  msg["late"] = st.late;
+  msg["rightSteps"] = rightMotor.steps();
+  msg["leftSteps"] = leftMotor.steps();
+  // the stats so far are sent, then start again
+  if (inJson["arg"].is<JsonObject&>() && inJson["arg"]["reset"]) {
+    ShiftStepper::resetStats();
+  }
+}
 
-void Evebrain::takeUpSlack(byte rightMotorDir, byte leftMotorDir){
-  // Take up the slack on each motor
-  takeUpSlackRight(rightMotorDir);
-  takeUpSlackLeft(leftMotorDir);
+void Evebrain::_stats(ArduinoJson::JsonObject &inJson, ArduinoJson::JsonObject &outJson){
+  const char *id = inJson["id"];
+  const char *name = inJson["arg"];
+  if(!cmdProcessor.sendStats(id ? id : "", name ? name : "")){
+    outJson["status"] = "error";
+    outJson["msg"] = "Command not recognised";
+  }else if(!name || !name[0]){
+    JsonObject& msg = outJson.createNestedObject("msg");
+    msg["maxPollGap"] = maxPollGap;
+    maxPollGap = 0;
+  }
 }
 
-void Evebrain::takeUpSlackLeft(byte leftMotorDir) {
-  if(leftMotor.lastDirection != leftMotorDir){
-    leftMotor.turn(settings.slackCalibration, leftMotorDir);
-    // wait until the motor is done spinning
-    while (!leftMotor.ready()) {}
+void Evebrain::takeUpSlack(byte rightMotorDir, byte leftMotorDir){
+  // Take up the slack on both motors at once, without moving any further
+  if(rightMotor.lastDirection != rightMotorDir || leftMotor.lastDirection != leftMotorDir){
+    rightMotor.plan(0, rightMotorDir);
+    leftMotor.plan(0, leftMotorDir);
+    ShiftStepper::queuePlanned();
   }
 }
 
-void Evebrain::takeUpSlackRight(byte rightMotorDir) {
-  if(rightMotor.lastDirection != rightMotorDir){
-    rightMotor.turn(settings.slackCalibration, rightMotorDir);
-    // wait until the motor is done spinning
-    while (!rightMotor.ready()) {}
+boolean Evebrain::queueMove(long rightSteps, byte rightDir, float rightSpeed, long leftSteps, byte leftDir, float leftSpeed){
+  // the next drive command stops this, rather than driving on in its place
+  driving = false;
+  if(!rightSteps && !leftSteps) return true;
+  if(!ShiftStepper::segmentsFree()) return false;
+  // motors that change direction take up their slack as part of the move
+  if(rightSteps){
+    rightMotor.setRelSpeed(rightSpeed);
+    rightMotor.plan(rightSteps, rightDir);
+  }
+  if(leftSteps){
+    leftMotor.setRelSpeed(leftSpeed);
+    leftMotor.plan(leftSteps, leftDir);
   }
+  ShiftStepper::queuePlanned();
+  // if this is a streamed command, it completes when this segment does
+  cmdProcessor.completeAfter(ShiftStepper::lastQueued());
+  return true;
 }
 
-void Evebrain::forward(int distance){
-  takeUpSlack(FORWARD, BACKWARD);
-  rightMotor.turn(distance * steps_per_mm * settings.moveCalibration, FORWARD);
-  leftMotor.turn(distance * steps_per_mm * settings.moveCalibration, BACKWARD);
+boolean Evebrain::forward(int distance){
+  long steps = distance * steps_per_mm * settings.moveCalibration;
+  boolean queued = queueMove(steps, FORWARD, 1.0, steps, BACKWARD, 1.0);
   wait();
+  return queued;
 }
 
-void Evebrain::back(int distance){
-  takeUpSlack(BACKWARD, FORWARD);
-  rightMotor.turn(distance * steps_per_mm * settings.moveCalibration, BACKWARD);
-  leftMotor.turn(distance * steps_per_mm * settings.moveCalibration, FORWARD);
+boolean Evebrain::back(int distance){
+  long steps = distance * steps_per_mm * settings.moveCalibration;
+  boolean queued = queueMove(steps, BACKWARD, 1.0, steps, FORWARD, 1.0);
   wait();
+  return queued;
 }
 
-void Evebrain::left(int angle){
-  takeUpSlack(FORWARD, FORWARD);
-  rightMotor.turn(angle * steps_per_degree * settings.turnCalibration, FORWARD);
-  leftMotor.turn(angle * steps_per_degree * settings.turnCalibration, FORWARD);
+boolean Evebrain::left(int angle){
+  long steps = angle * steps_per_degree * settings.turnCalibration;
+  boolean queued = queueMove(steps, FORWARD, 1.0, steps, FORWARD, 1.0);
   wait();
+  return queued;
 }
 
-void Evebrain::right(int angle){
-  takeUpSlack(BACKWARD, BACKWARD);
-  rightMotor.turn(angle * steps_per_degree * settings.turnCalibration, BACKWARD);
-  leftMotor.turn(angle * steps_per_degree * settings.turnCalibration, BACKWARD);
+boolean Evebrain::right(int angle){
+  long steps = angle * steps_per_degree * settings.turnCalibration;
+  boolean queued = queueMove(steps, BACKWARD, 1.0, steps, BACKWARD, 1.0);
   wait();
+  return queued;
 }
 
 void Evebrain::pause(){
@@ -681,6 +894,7 @@ void Evebrain::stop(){
   rightMotor.stop();
   leftMotor.stop();
   calibratingSlack = false;
+  driving = false;
 }
 
 void ICACHE_FLASH_ATTR Evebrain::beep(int semi_tone, int duration){
@@ -907,11 +1121,13 @@ void ICACHE_FLASH_ATTR Evebrain::postToServer(){
 void Evebrain::servo(int angle, int pin){
   // Set up the servo
   if(pin == 0){ 
-    pinMode(SERVO_PIN, OUTPUT);
-    servo_pulses_left = abs(servoPosition - angle);
-    //Serial.println(servo_pulses_left);
-    next_servo_pulse = 0;
+    // Keep pulsing for as long as it takes the servo to turn that far, in
+    // whole frames
+    servo_pulses_left = (abs(servoPosition - angle) * SERVO_US_PER_DEGREE + SERVO_FRAME_US - 1) / SERVO_FRAME_US;
     servoPosition = angle;
+    if(servo_pulses_left){
+      ServoPulses::start(SERVO_PIN, (((servoPosition%181)/90)+0.5)*1000, servo_pulses_left);
+    }
     wait();
   }
   if(pin == 1){
@@ -923,50 +1139,93 @@ void Evebrain::servo(int angle, int pin){
   }
 }
 
-void Evebrain::leftMotorForward(int distance){
-  takeUpSlackLeft(FORWARD);
-  leftMotor.turn(distance * steps_per_mm * settings.turnCalibration, FORWARD);
+boolean Evebrain::leftMotorForward(int distance){
+  boolean queued = queueMove(0, FORWARD, 1.0, distance * steps_per_mm * settings.turnCalibration, FORWARD, 1.0);
   wait();
+  return queued;
 }
 
-void Evebrain::rightMotorForward(int distance){
-  takeUpSlackRight(FORWARD);
-  rightMotor.turn(distance * steps_per_mm * settings.turnCalibration, FORWARD);
+boolean Evebrain::rightMotorForward(int distance){
+  boolean queued = queueMove(distance * steps_per_mm * settings.turnCalibration, FORWARD, 1.0, 0, FORWARD, 1.0);
   wait();
+  return queued;
 }
 
-void Evebrain::leftMotorBackward(int distance){
-  takeUpSlackLeft(BACKWARD);
-  leftMotor.turn(distance * steps_per_mm * settings.turnCalibration, BACKWARD);
+boolean Evebrain::leftMotorBackward(int distance){
+  boolean queued = queueMove(0, BACKWARD, 1.0, distance * steps_per_mm * settings.turnCalibration, BACKWARD, 1.0);
   wait();
+  return queued;
 }
 
-void Evebrain::rightMotorBackward(int distance){
-  takeUpSlackRight(BACKWARD);
-  rightMotor.turn(distance * steps_per_mm * settings.turnCalibration, BACKWARD);
+boolean Evebrain::rightMotorBackward(int distance){
+  boolean queued = queueMove(distance * steps_per_mm * settings.turnCalibration, BACKWARD, 1.0, 0, BACKWARD, 1.0);
+  wait();
+  return queued;
+}
+
+boolean Evebrain::speedMove(float leftDistance, float leftSpeed, float rightDistance, float rightSpeed){
+  return speedMoveSteps(leftDistance * steps_per_mm, leftSpeed, rightDistance * steps_per_mm, rightSpeed);
+}
+
+boolean Evebrain::arc(float radius, float angle, float speed){
+  // Each wheel follows its own arc, half the wheel distance either side of the
+  // middle. Inside a radius of less than that, the inner wheel goes backwards.
+  float theta = fabs(angle) * PI / 180;
+  float outer = (radius + settings.wheelDistance / 2) * theta;
+  float inner = (radius - settings.wheelDistance / 2) * theta;
+  long outerSteps = outer * steps_per_mm * settings.moveCalibration;
+  long innerSteps = fabs(inner) * steps_per_mm * settings.moveCalibration;
+  // the inner wheel goes slower so that both wheels finish together
+  float innerSpeed = outerSteps ? speed * innerSteps / outerSteps : speed;
+  byte innerForward = inner >= 0;
+  boolean queued;
+  if (angle >= 0) {
+    // turning left, so the right wheel is on the outside
+    queued = queueMove(outerSteps, FORWARD, speed, innerSteps, innerForward ? BACKWARD : FORWARD, innerSpeed);
+  } else {
+    queued = queueMove(innerSteps, innerForward ? FORWARD : BACKWARD, innerSpeed, outerSteps, BACKWARD, speed);
+  }
   wait();
+  return queued;
 }
 
-void Evebrain::speedMove(float leftDistance, float leftSpeed, float rightDistance, float rightSpeed){
-  speedMoveSteps(leftDistance * steps_per_mm, leftSpeed, rightDistance * steps_per_mm, rightSpeed);
+// Plans one wheel's part of a drive, with enough steps to last until the
+// timeout. The direction is the one that moves the robot forward.
+static void planDrive(ShiftStepper &motor, float speed, float steps, byte forwardDir){
+  // left out of the segment, so it slows to a stop
+  if (speed == 0) {
+    return;
+  }
+  float absSpeed = fabs(speed);
+  // make sure speed is not too low.
+  if (absSpeed < 0.1) {
+    absSpeed = 0.1;
+  }
+  motor.setRelSpeed(absSpeed);
+  motor.plan(steps * absSpeed, speed > 0 ? forwardDir : !forwardDir);
 }
 
-void Evebrain::speedMoveSteps(int leftSteps, float leftSpeed, int rightSteps, float rightSpeed){
-  byte rightMotorDir = rightSteps > 0 ? FORWARD : BACKWARD, leftMotorDir = leftSteps > 0 ? FORWARD : BACKWARD;
-  if (rightSteps != 0) {
-    takeUpSlackRight(rightMotorDir);
-    // taking up slack resets the speed to 1.
-    rightMotor.setRelSpeed(rightSpeed);
-    long steps = abs(rightSteps) * settings.turnCalibration;
-    rightMotor.turn(steps, rightMotorDir);
-  }
-  if (leftSteps != 0) {
-    takeUpSlackLeft(leftMotorDir);
-    // taking up slack resets the speed to 1.
-    leftMotor.setRelSpeed(leftSpeed);
-    long steps = abs(leftSteps) * settings.turnCalibration;
-    leftMotor.turn(steps, leftMotorDir);
+void Evebrain::drive(float leftSpeed, float rightSpeed){
+  if(!driving){
+    // take over from any moves in progress, as stop would
+    if(!(rightMotor.ready() && leftMotor.ready()) || calibratingSlack){
+      cmdProcessor.cancelQueue();
+      stop();
+    }
+    driving = true;
   }
+  // The wheels run out of steps (slowing to a stop just before) once the
+  // timeout has passed, so they stop even if the loop doesn't get to run
+  float steps = settings.driveTimeout * 1000.0f / ShiftStepper::fullSpeedPeriod();
+  planDrive(rightMotor, rightSpeed, steps, FORWARD);
+  planDrive(leftMotor, leftSpeed, steps, BACKWARD);
+  ShiftStepper::drivePlanned();
+}
+
+boolean Evebrain::speedMoveSteps(int leftSteps, float leftSpeed, int rightSteps, float rightSpeed){
+  byte rightMotorDir = rightSteps > 0 ? FORWARD : BACKWARD, leftMotorDir = leftSteps > 0 ? FORWARD : BACKWARD;
+  return queueMove(abs(rightSteps) * settings.turnCalibration, rightMotorDir, rightSpeed,
+            abs(leftSteps) * settings.turnCalibration, leftMotorDir, leftSpeed);
 }
 
 void Evebrain::readSensors(byte pin){
@@ -1001,6 +1260,93 @@ void Evebrain::version(char v){
 }
 
 
+// The same angle, from -180 to 180
+static float wrapAngle(float angle){
+  angle = fmod(angle, 360);
+  if(angle > 180){
+    angle -= 360;
+  }else if(angle <= -180){
+    angle += 360;
+  }
+  return angle;
+}
+
+void Evebrain::resetPose(){
+  poseX = 0;
+  poseY = 0;
+  poseAngle = 0;
+  poseRightSteps = rightMotor.position();
+  poseLeftSteps = leftMotor.position();
+}
+
+void Evebrain::updatePose(){
+  long right = rightMotor.position(), left = leftMotor.position();
+  // the left motor turns BACKWARD to go forward
+  long rightSteps = right - poseRightSteps, leftSteps = poseLeftSteps - left;
+  if(!rightSteps && !leftSteps) return;
+  poseChanged = true;
+  poseRightSteps = right;
+  poseLeftSteps = left;
+  // undo the calibration that forward and left put on the steps
+  float distance = (rightSteps + leftSteps) / 2.0f / (steps_per_mm * settings.moveCalibration);
+  float turn = (rightSteps - leftSteps) / 2.0f / (steps_per_degree * settings.turnCalibration);
+  // take the heading half way through the turn, as a move is an arc
+  float heading = (poseAngle + turn / 2) * PI / 180;
+  poseX += distance * cos(heading);
+  poseY += distance * sin(heading);
+  poseAngle = wrapAngle(poseAngle + turn);
+}
+
+void Evebrain::queueTurn(float angle, float speed){
+  long steps = lround(fabs(angle) * steps_per_degree * settings.turnCalibration);
+  byte dir = angle > 0 ? FORWARD : BACKWARD;
+  queueMove(steps, dir, speed, steps, dir, speed);
+}
+
+void Evebrain::queueStraight(float distance, float speed){
+  long steps = lround(distance * steps_per_mm * settings.moveCalibration);
+  queueMove(steps, FORWARD, speed, steps, BACKWARD, speed);
+}
+
+boolean Evebrain::goTo(float x, float y, float heading, float speed){
+  // all of it or none of it, rather than stopping part way
+  if (ShiftStepper::segmentsFree() < 3) {
+    return false;
+  }
+  // Goto isn't streamed and isn't run while driving, so the wheels have
+  // stopped and the pose is where they left the robot
+  updatePose();
+  float dx = x - poseX, dy = y - poseY;
+  float distance = sqrt(dx * dx + dy * dy);
+  float facing = poseAngle;
+  // less than a step away, so there's nothing to face
+  if (distance * steps_per_mm >= 1) {
+    facing = atan2(dy, dx) * 180 / PI;
+    queueTurn(wrapAngle(facing - poseAngle), speed);
+    queueStraight(distance, speed);
+  }
+  if (!isnan(heading)) {
+    queueTurn(wrapAngle(heading - facing), speed);
+  }
+  wait();
+  return true;
+}
+
+void Evebrain::poseNotifier(){
+  // only while it's moving
+  if(!poseInterval || !poseChanged || millis() - lastPoseNotify < poseInterval) return;
+  poseChanged = false;
+  lastPoseNotify = millis();
+  // room for the id and status that notify adds
+  StaticJsonBuffer<JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(3)> outBuffer;
+  JsonObject& outMsg = outBuffer.createObject();
+  JsonObject& msg = outMsg.createNestedObject("msg");
+  msg["x"] = poseX;
+  msg["y"] = poseY;
+  msg["angle"] = poseAngle;
+  cmdProcessor.notify("pose", outMsg);
+}
+
 void Evebrain::networkNotifier(){
   if(!EvebrainWifi::networkChanged) return;
   DynamicJsonBuffer outBuffer;
@@ -1026,9 +1372,13 @@ void Evebrain::wifiScanNotifier(){
 void Evebrain::calibrateSlack(unsigned int amount){
   settings.slackCalibration = amount;
   saveSettings();
+  ShiftStepper::setSlack(amount);
   calibratingSlack = true;
-  rightMotor.turn(1, FORWARD);
-  leftMotor.turn(1, BACKWARD);
+  // the next drive command stops this, rather than driving on in its place
+  driving = false;
+  rightMotor.plan(1, FORWARD);
+  leftMotor.plan(1, BACKWARD);
+  ShiftStepper::queuePlanned();
 }
 
 
@@ -1052,7 +1402,10 @@ void Evebrain::calibrateHandler(){
 
 
 boolean Evebrain::ready(){
-  return (rightMotor.ready() && leftMotor.ready() && !servo_pulses_left && timeTillComplete < millis());
+  // While driving the wheels only ever have drive segments, which no command
+  // waits on, so they don't hold up the commands that aren't moves
+  boolean motorsReady = driving || (rightMotor.ready() && leftMotor.ready());
+  return (motorsReady && !servo_pulses_left && timeTillComplete < millis());
 }
 
 void Evebrain::wait(){
@@ -1072,17 +1425,12 @@ void Evebrain::ledHandler(){
 }
 
 void Evebrain::servoHandler(){
+  // the pulses are sent from the timer, this just sees when they're done
   if(servo_pulses_left){
-    if(micros() >= next_servo_pulse){
-      servo_pulses_left--;
+    servo_pulses_left = ServoPulses::pulsesLeft(SERVO_PIN);
+    // if now done, pull pin 10 HIGH as a precaution
+    if (servo_pulses_left == 0) {
       digitalWrite(SERVO_PIN, HIGH);
-      delayMicroseconds((((servoPosition%181)/90)+0.5)*1000);
-      digitalWrite(SERVO_PIN, LOW);
-      next_servo_pulse = micros() + (12000 - (((servoPosition%181)/90)+0.5)*1000);
-      // if now done, pull pin 10 HIGH as a precaution
-      if (servo_pulses_left == 0) {
-        digitalWrite(SERVO_PIN, HIGH);
-      }
     }
   }
 }
@@ -1109,6 +1457,19 @@ void Evebrain::serialHandler(){
         }else if(res == SERWS_HEADERS_PROCESSED || res == SERWS_FRAME_ERROR || res == SERWS_FRAME_EMPTY){
           serial_buffer_pos = 0;
         }
+      }else if(serial_binary || (serial_buffer_pos == 0 && incomingByte == BINARY_FRAME_START)){
+        // Handle a binary command frame: start byte, length byte, then the frame.
+        // The buffer holds the longest length the byte can give, so it never overflows.
+        if(!serial_binary){
+          serial_binary = true;
+        }else{
+          serial_buffer[serial_buffer_pos++] = incomingByte;
+          if(serial_buffer_pos == (uint8_t)serial_buffer[0] + 1){
+            cmdProcessor.processBinaryMsg((uint8_t*)&serial_buffer[1], serial_buffer_pos - 1);
+            serial_binary = false;
+            serial_buffer_pos = 0;
+          }
+        }
       }else{
         // Handle as a stream of commands
         if((incomingByte == '\r' || incomingByte == '\n') && serial_buffer_pos && cmdProcessor.processMsg(serial_buffer)){
@@ -1126,6 +1487,7 @@ void Evebrain::serialHandler(){
     //reset the input buffer if nothing is received for 1/2 second to avoid things getting messed up
     if(millis() - last_char >= 500){
       serial_buffer_pos = 0;
+      serial_binary = false;
     }
   }
 }
@@ -1148,6 +1510,12 @@ void Evebrain::digitalNotifyHandler() {
 
 void Evebrain::checkReady(){
   char snum[5];
+  uint16_t segment;
+  // streamed moves complete as soon as their own segment has finished, while
+  // the moves queued after them carry on
+  while(cmdProcessor.currentTag(segment) && ShiftStepper::segmentDone(segment)){
+    cmdProcessor.sendComplete();
+  }
   if(cmdProcessor.in_process && ready()){
     //if temperature ready is ready
     if (temperatureRead){
@@ -1208,26 +1576,50 @@ void Evebrain::checkReady(){
       cmdProcessor.sendComplete();
     }
   }
+  // start the next command if any are waiting
+  cmdProcessor.processQueue();
 }
 
 unsigned long previousPostTime = 0;
 
+void Evebrain::pollCommands(){
+  // how long a stop could have waited to be read
+  unsigned long now = micros();
+  if(lastPoll && now - lastPoll > maxPollGap){
+    maxPollGap = now - lastPoll;
+  }
+  lastPoll = now;
+  serialHandler();
+  // connect to websocket client (if one is trying to connect) and check for incoming message
+  websocketPoll();
+}
+
 void Evebrain::loop()
 {
+  // Incoming commands are handled first, and again part way through, so that
+  // stop/pause/resume (CMD_PRIORITY) never wait behind a whole pass of the
+  // housekeeping below. Worst case, a stop waits for the longest stretch
+  // between two input polls, which stats reports as maxPollGap. Moves, slack
+  // takeup included, and servo pulses run from the timers and never block
+  // here, but a distance reading (up to 20ms), saving settings, reconnecting
+  // wifi and posting to a server (postToServer, not bounded) all do.
+  pollCommands();
+  checkReady();
+  // kept up to date every pass, so that each step of a run of moves is taken
+  // the right way, not lumped in with the moves either side of it
+  updatePose();
   ledHandler();
   servoHandler();
   calibrateHandler();
   networkNotifier();
   wifiScanNotifier();
+  poseNotifier();
   if(wifiEnabled){
     wifi.run();
   }
   PinServos::poll();
-  serialHandler();
-  checkReady();
+  pollCommands();
   ota.runOTA();
-  // connect to websocket client (if one is trying to connect) and check for incoming message
-  websocketPoll();
   digitalNotifyHandler();
   PinServos::poll();
 
@@ -18,7 +18,8 @@
 #include <WiFiClientSecureBearSSL.h>
 
 #define FORCE_SETUP 1
-#define SERIAL_BUFFER_LENGTH 180
+// Room for the length byte and the longest binary frame (also plenty for a line of JSON)
+#define SERIAL_BUFFER_LENGTH (BINARY_FRAME_MAX_LENGTH + 1)
 
 // The steppers have a gear ratio of 1:63.7 and have 32 steps per turn, and we are driving with half steps.
 // 2 x 32 x 63.7 = 4076.8
@@ -26,6 +27,15 @@
 
 #define DEFAULT_DIAMETER_MM_V2  80.97804f
 #define DEFAULT_WHEEL_DISTANCE_V2    108.5f
+// Acceleration and deceleration of the wheels, in mm/s^2
+#define DEFAULT_ACCELERATION 200.0f
+#define MAX_ACCELERATION 10000.0f
+// How long drive keeps the wheels going without another drive command, in ms
+#define DEFAULT_DRIVE_TIMEOUT 500
+#define MIN_DRIVE_TIMEOUT 100
+#define MAX_DRIVE_TIMEOUT 10000
+// Shortest time between pose notifications, in ms
+#define MIN_POSE_INTERVAL 20
 #define PENUP_DELAY_V2 2000
 #define PENDOWN_DELAY_V2 1100
 
@@ -39,12 +49,15 @@
 #define SETTINGS_VERSION 2
 
 #define SERVO_PULSES 30
+// How long the main servo is pulsed for each degree it turns
+#define SERVO_US_PER_DEGREE 12000
 #define DHTPIN 16 
 #define TRIGPIN 5
 #define ECHOPIN 4
 #define SPEAKER_PIN 5
 #define SERVO_PIN 10
 #define SERVO_PIN_TWO 16
+// Bit-banged, as these aren't the HSPI pins (see ShiftStepper.h)
 #define SHIFT_REG_DATA  12
 #define SHIFT_REG_CLOCK 13
 #define SHIFT_REG_LATCH 14
@@ -81,6 +94,9 @@ struct EvebrainSettings {
   bool         toggleDistancePosting;
   char         hostServer[64];
   byte         serverRequestTime;
+  float        acceleration;
+  unsigned int driveTimeout;
+  unsigned int servoHold;
 };
 
 class Evebrain {
@@ -91,10 +107,11 @@ class Evebrain {
     void hmc5883l_init();
     void enableSerial();
     void enableWifi();
-    void forward(int);
-    void back(int);
-    void right(int);
-    void left(int);
+    // The moves return false, without moving, if there isn't room to queue them
+    boolean forward(int);
+    boolean back(int);
+    boolean right(int);
+    boolean left(int);
     void pause();
     void resume();
     void stop();
@@ -106,12 +123,26 @@ class Evebrain {
     void gpio_on(byte);
     void gpio_off(byte);
     void gpio_pwm(byte, byte);
-    void leftMotorForward(int);
-    void rightMotorForward(int);
-    void leftMotorBackward(int);
-    void rightMotorBackward(int);
-    void speedMove(float leftDistance, float leftSpeed, float rightDistance, float rightSpeed);
-    void speedMoveSteps(int, float, int, float);
+    boolean leftMotorForward(int);
+    boolean rightMotorForward(int);
+    boolean leftMotorBackward(int);
+    boolean rightMotorBackward(int);
+    boolean speedMove(float leftDistance, float leftSpeed, float rightDistance, float rightSpeed);
+    boolean speedMoveSteps(int, float, int, float);
+    // Drives along an arc of the given radius (mm, to the middle of the robot)
+    // through an angle in degrees, turning left for positive angles
+    boolean arc(float radius, float angle, float speed);
+    // Drives each wheel at a signed speed (-1 to 1) until the next call, or
+    // slows to a stop if there isn't one within the drive timeout
+    void drive(float leftSpeed, float rightSpeed);
+    // Where the robot has got to from the steps the wheels have taken: x and y
+    // in mm from where it started (or was reset), x ahead and y to the left of
+    // where it was facing then, and the angle in degrees, anticlockwise
+    float poseX, poseY, poseAngle;
+    void resetPose();
+    // Turns to face (x, y), drives there and turns to the heading (unless it's
+    // NAN), all as one command. The target is in the same frame as the pose.
+    boolean goTo(float x, float y, float heading, float speed);
     void servo(int,int);
     void temperature();
     void humidity();
@@ -137,6 +168,8 @@ class Evebrain {
     void servoHandler();
     void networkNotifier();
     void wifiScanNotifier();
+    void updatePose();
+    void poseNotifier();
     void sensorNotifier();
     void checkState();
     void initSettings();
@@ -145,7 +178,12 @@ class Evebrain {
     void checkReady();
     void version(char);
     void initCmds();
+    static const Cmd cmds[];
     void serialHandler();
+    void pollCommands();
+    // Longest time between two input polls, in us, since it was last reported
+    unsigned long lastPoll;
+    unsigned long maxPollGap;
     void digitalNotifyHandler();
     void _version(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _ping(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
@@ -169,6 +207,10 @@ class Evebrain {
     void _leftMotorBackward(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _rightMotorBackward(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _speedMove(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _arc(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _drive(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _pose(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _goTo(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _speedMoveSteps(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _analogInput(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _readSensors(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
@@ -192,7 +234,10 @@ class Evebrain {
     void _setConfig(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _resetConfig(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _freeHeap(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _freeStack(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     void _startWifiScan(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _stats(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
+    void _stepperStats(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
     long duration;
     byte distanceVar;
     float temperatureVar;
@@ -209,15 +254,27 @@ class Evebrain {
     boolean servoMove;
     boolean nextADCRead;
     byte servoPosition;
-    unsigned long next_servo_pulse;
     unsigned char servo_pulses_left;
     unsigned long lastLedChange;
     Evebrain& self() { return *this; }
     void takeUpSlack(byte, byte);
-    void takeUpSlackRight(byte);
-    void takeUpSlackLeft(byte);
+    // Queues a move of both wheels as one segment, slack takeup included.
+    // Returns false if there isn't room in the segment buffer.
+    boolean queueMove(long rightSteps, byte rightDir, float rightSpeed, long leftSteps, byte leftDir, float leftSpeed);
+    // Queue turning on the spot (degrees, anticlockwise) and driving straight (mm)
+    void queueTurn(float angle, float speed);
+    void queueStraight(float distance, float speed);
     void calibrateHandler();
     boolean paused;
+    // Driving from drive commands, rather than moving a set distance
+    boolean driving;
+    // Motor positions the pose was last worked out from
+    long poseRightSteps;
+    long poseLeftSteps;
+    // How often to notify the pose (0 for never), in ms
+    unsigned int poseInterval;
+    unsigned long lastPoseNotify;
+    boolean poseChanged;
     float steps_per_mm;
     float steps_per_degree;
     long timeTillComplete;
@@ -226,6 +283,7 @@ class Evebrain {
     unsigned long last_char;
     char serial_buffer[SERIAL_BUFFER_LENGTH];
     int serial_buffer_pos;
+    boolean serial_binary;
     boolean wifiEnabled;
     char post[256];
     //const uint8_t default_fingerprint[20] = {0x56, 0x03, 0xf0, 0x21, 0x8b, 0x25, 0xad, 0x7b, 0xbd, 0xdf, 0x5d, 0x03, 0x65, 0x52, 0x84, 0x0a, 0x5f, 0xff, 0x46, 0x74};
@@ -1,13 +1,22 @@
 #include "CmdProcessor.h"
+#include "Evebrain.h"
 #include "sha1.h"
 #include "Base64.h"
 
 CmdProcessor::CmdProcessor(){
   in_process = false;
-  current_id[0] = 0;
+  _cmds = NULL;
+  cmd_count = 0;
+  opcodeIndex = NULL;
+  maxOpcode = 0;
+  inflightFirst = 0;
+  inflightCount = 0;
+  pendingTagged = false;
+  parse_us = 0;
+  stats = NULL;
 }
 
-bool CmdProcessor::addOutputHandler(jsonMsgHandler h){
+bool CmdProcessor::addOutputHandler(msgHandler h){
   for(int i = 0; i< OUTPUT_HANDLER_COUNT; i++){
     if(outputHandlers[i] == NULL){
       outputHandlers[i] = h;
@@ -21,115 +30,407 @@ void CmdProcessor::setEvebrain(Evebrain &m){
   _m = &m;
 }
 
-void CmdProcessor::addCmd(const char cmd[], EvebrainMemFn func, bool immediate){
-  if (cmd_counter == CMD_COUNT) {
-    Serial.println(F("Too many commands defined"));
-    return;
+void CmdProcessor::setCmds(const Cmd cmds[], int count){
+  _cmds = cmds;
+  cmd_count = count;
+  free(stats);
+  stats = (CmdStats*)calloc(cmd_count, sizeof(CmdStats));
+  if(!stats){
+    Serial.println(F("No room to keep command statistics"));
+  }
+  // The lookup relies on the table being in strcmp order
+  for(int i = 1; i < cmd_count; i++){
+    char prev[CMD_NAME_LENGTH];
+    strcpy_P(prev, _cmds[i - 1].cmd);
+    if(strcmp_P(prev, _cmds[i].cmd) >= 0){
+      Serial.print(F("Command table not sorted at "));
+      Serial.println(prev);
+    }
+  }
+  // Binary frames look commands up by opcode, so index them that way too
+  maxOpcode = 0;
+  for(int i = 0; i < cmd_count; i++){
+    uint8_t opcode = pgm_read_byte(&_cmds[i].opcode);
+    if(opcode > maxOpcode) maxOpcode = opcode;
+  }
+  free(opcodeIndex);
+  opcodeIndex = (uint8_t*)calloc(maxOpcode + 1, 1);
+  for(int i = 0; opcodeIndex && i < cmd_count; i++){
+    uint8_t opcode = pgm_read_byte(&_cmds[i].opcode);
+    if(opcodeIndex[opcode]){
+      Serial.print(F("Opcode used twice: "));
+      Serial.println(opcode);
+    }
+    opcodeIndex[opcode] = i + 1;
   }
-  _cmds[cmd_counter].cmd = cmd;
-  _cmds[cmd_counter].func = func;
-  _cmds[cmd_counter].immediate = immediate;
-  cmd_counter++;
+}
+
+int CmdProcessor::findCmd(const char *cmd){
+  int low = 0;
+  int high = cmd_count - 1;
+  while(low <= high){
+    int mid = (low + high) / 2;
+    int res = strcmp_P(cmd, _cmds[mid].cmd);
+    if(res == 0){
+      return mid;
+    }else if(res < 0){
+      high = mid - 1;
+    }else{
+      low = mid + 1;
+    }
+  }
+  return -1;
 }
 
 boolean CmdProcessor::processMsg(char * msg){
-  const char* cmd;
-  const char* id;
-  int cmd_num, i;
-  StaticJsonBuffer<JSON_BUFFER_LENGTH> incomingBuffer;
-  StaticJsonBuffer<JSON_BUFFER_LENGTH> outgoingBuffer;
+  incomingBuffer.clear();
+  outgoingBuffer.clear();
   JsonObject& outMsg = outgoingBuffer.createObject();
-  
+  uint32_t start = micros();
+
+  while(isspace(*msg)) msg++;
+  if(*msg == '['){
+    JsonArray& batch = incomingBuffer.parseArray(msg);
+    parse_us = micros() - start;
+    if(batch.success()){
+      runBatch(batch);
+      return true;
+    }
+    outMsg["msg"] = "JSON parse error";
+    sendResponse("error", outMsg, (const char &)"");
+    return true;
+  }
+
   JsonObject& inMsg = incomingBuffer.parseObject(msg);
+  parse_us = micros() - start;
   if(inMsg.success()){
+    if(inMsg.containsKey("cmds")){
+      runBatch(inMsg["cmds"].asArray());
+      return true;
+    }
     // Extract the command
     if(!inMsg.containsKey("cmd")) return false;
-    cmd = inMsg["cmd"];
+    runCmd(inMsg, outMsg, false);
+  }else{
+    //Error parsing
+    outMsg["msg"] = "JSON parse error";
+    sendResponse("error", outMsg, (const char &)"");
+  }
+  return true;
+}
 
-    // Extract the ID
-    if(inMsg.containsKey("id")){
-      id = inMsg["id"];
+void CmdProcessor::runCmd(ArduinoJson::JsonObject &inMsg, ArduinoJson::JsonObject &outMsg, bool fromQueue){
+  const char* cmd;
+  const char* id;
+  int cmd_num;
+
+  cmd = inMsg["cmd"];
+
+  // Extract the ID
+  if(inMsg.containsKey("id")){
+    id = inMsg["id"];
+  }else{
+    id = "";
+  }
+
+  // Find the command
+  cmd_num = findCmd(cmd);
+
+  // Process the command
+  if(cmd_num >= 0){
+    dispatch(cmd_num, id, inMsg, outMsg, fromQueue);
+  }else{
+    // the command isn't recognised, send an error
+    outMsg["msg"] = "Command not recognised";
+    sendResponse("error", outMsg, *id);
+  }
+}
+
+void CmdProcessor::runBatch(ArduinoJson::JsonArray &cmds){
+  if(!cmds.success() || cmds.size() > CMD_BATCH_LENGTH){
+    JsonObject& outMsg = outgoingBuffer.createObject();
+    outMsg["msg"] = "Batch error";
+    sendResponse("error", outMsg, (const char &)"");
+    return;
+  }
+  for(JsonArray::iterator it = cmds.begin(); it != cmds.end(); ++it){
+    // each response is sent before the next command runs, so the outgoing
+    // buffer can be reused for every command in the batch
+    outgoingBuffer.clear();
+    JsonObject& outMsg = outgoingBuffer.createObject();
+    JsonObject& inMsg = it->asObject();
+    if(inMsg.success() && inMsg.containsKey("cmd")){
+      runCmd(inMsg, outMsg, false);
     }else{
-      id = "";
+      outMsg["msg"] = "Command not recognised";
+      sendResponse("error", outMsg, (const char &)"");
     }
+  }
+}
 
-    // Find the command
-    cmd_num = -1;
-    for(i = 0; i < cmd_counter; i++){
-      if(!strcmp(cmd, _cmds[i].cmd)){
-        cmd_num = i;
-        break;
+void CmdProcessor::dispatch(int cmd_num, const char *id, ArduinoJson::JsonObject &inMsg, ArduinoJson::JsonObject &outMsg, bool fromQueue){
+  EvebrainMemFn func;
+  uint8_t flags;
+
+  memcpy_P(&func, &_cmds[cmd_num].func, sizeof(func));
+  flags = pgm_read_byte(&_cmds[cmd_num].flags);
+  CmdStats *st = stats ? &stats[cmd_num] : NULL;
+  uint32_t start;
+  // priority commands are never replayed, a repeated stop must always stop
+  boolean cacheable = id[0] && !(flags & (CMD_PRIORITY | CMD_NOCACHE));
+  uint32_t hash = 0;
+  if(cacheable){
+    hash = ResponseCache::hash(inMsg["cmd"], id, inMsg["arg"]);
+    if(!fromQueue){
+      // a retry of a command already run, or still waiting in the queue
+      CachedResponse *cached = responses.find(id, hash);
+      if(cached){
+        sendRaw(cached->msg, cached->len);
+        return;
+      }
+      QueuedCmd *queued = queue.find(id);
+      if(queued && queued->hash == hash){
+        return;
       }
     }
-
-    // Process the command
-    if(cmd_num >= 0){
-      if(_cmds[cmd_num].immediate){
-        (_m->*(_cmds[cmd_num].func))(inMsg, outMsg);
-        // kludge to allow an error condition to notify Snap
-        if (outMsg.containsKey("status") &&
-            strcmp(outMsg["status"], "error") == 0) {
-          sendResponse("error", outMsg, *id);
-        } else {
-          sendResponse("complete", outMsg, *id);
-        }
+  }
+  // priority commands never wait behind the queue or the command in progress
+  if(flags & (CMD_IMMEDIATE | CMD_PRIORITY)){
+    start = micros();
+    (_m->*func)(inMsg, outMsg);
+    recordRun(st, micros() - start);
+    // kludge to allow an error condition to notify Snap. Errors aren't
+    // cached, so that a retry runs again (e.g. once there's room for a move)
+    if (outMsg.containsKey("status") &&
+        strcmp(outMsg["status"], "error") == 0) {
+      sendResponse("error", outMsg, *id);
+    } else {
+      size_t len = sendResponse("complete", outMsg, *id);
+      if(cacheable) responses.store(id, hash, outputBuffer, len);
+    }
+  }else if(!fromQueue && (queue.numberOfElements() || (in_process && !canStream(flags)))){
+    // the previous command hasn't finished, so hold this one until it has
+    if(!queue.push(id, hash, inMsg, flags)){
+      if(queue.full()){
+        outMsg["msg"] = "Command queue full";
       }else{
-        if(in_process){
-          // the previous command hasn't finished, send an error
-          outMsg["msg"] = "Previous command not finished";
-          sendResponse("error", outMsg, *id);
-        }else{
-          (_m->*(_cmds[cmd_num].func))(inMsg, outMsg);
-          strcpy(current_id, (char*)id);
-          in_process = true;
-          
-          // kludge to allow an error condition to notify Snap
-          if (outMsg.containsKey("status") &&
-            strcmp(outMsg["status"], "error") == 0) {
-            sendResponse("error", outMsg, *id);
-          } else {
-            sendResponse("accepted", outMsg, *id);
-          }
-        }
+        outMsg["msg"] = "Message too long to queue";
+        outMsg["maxLength"] = CMD_QUEUE_MSG_LENGTH - 1;
       }
-    }else{
-      // the command isn't recognised, send an error
-      outMsg["msg"] = "Command not recognised";
       sendResponse("error", outMsg, *id);
     }
   }else{
-    //Error parsing
-    outMsg["msg"] = "JSON parse error";
+    pendingTagged = false;
+    start = micros();
+    (_m->*func)(inMsg, outMsg);
+    recordRun(st, micros() - start);
+    InFlightCmd &c = inflight[(inflightFirst + inflightCount) % CMD_INFLIGHT_LENGTH];
+    strncpy(c.id, id, CMD_ID_LENGTH - 1);
+    c.id[CMD_ID_LENGTH - 1] = 0;
+    c.hash = hash;
+    c.cached = cacheable;
+    c.cmd = cmd_num;
+    c.flags = flags;
+    c.accepted_us = micros();
+    c.tagged = pendingTagged;
+    c.tag = pendingTag;
+    inflightCount++;
+    in_process = true;
+    
+    // kludge to allow an error condition to notify Snap
+    if (outMsg.containsKey("status") &&
+      strcmp(outMsg["status"], "error") == 0) {
+      sendResponse("error", outMsg, *id);
+      c.cached = false;
+    } else {
+      size_t len = sendResponse("accepted", outMsg, *id);
+      if(cacheable) responses.store(id, hash, outputBuffer, len);
+    }
+  }
+}
+
+int CmdProcessor::findOpcode(uint8_t opcode){
+  if(!opcodeIndex || opcode > maxOpcode){
+    return -1;
+  }
+  return opcodeIndex[opcode] - 1;
+}
+
+// Copies len bytes into the incoming buffer as a null terminated string
+char* CmdProcessor::copyString(const uint8_t *src, size_t len){
+  char *str = (char*)incomingBuffer.alloc(len + 1);
+  if(str){
+    memcpy(str, src, len);
+    str[len] = 0;
+  }
+  return str;
+}
+
+boolean CmdProcessor::processBinaryMsg(const uint8_t *msg, size_t len){
+  char cmd[CMD_NAME_LENGTH];
+  const char *id;
+  char *arg;
+  size_t id_len, arg_len;
+  int cmd_num;
+
+  uint32_t start = micros();
+  incomingBuffer.clear();
+  outgoingBuffer.clear();
+  JsonObject& outMsg = outgoingBuffer.createObject();
+
+  // Frame layout: opcode, id length, id, arg length, arg
+  if(len < 3 || len > BINARY_FRAME_MAX_LENGTH || (id_len = msg[1]) + 3 > len || (arg_len = msg[2 + id_len]) + id_len + 3 != len){
+    outMsg["msg"] = "Binary frame error";
     sendResponse("error", outMsg, (const char &)"");
+    return false;
+  }
+  id = copyString(&msg[2], id_len);
+  arg = copyString(&msg[3 + id_len], arg_len);
+  if(!id || !arg){
+    return false;
+  }
+
+  cmd_num = findOpcode(msg[0]);
+  if(cmd_num < 0){
+    outMsg["msg"] = "Command not recognised";
+    sendResponse("error", outMsg, *id);
+    return true;
+  }
+
+  // Build the same message the JSON path would have parsed, so handlers and
+  // the queue don't need to know which framing was used
+  JsonObject& inMsg = incomingBuffer.createObject();
+  strcpy_P(cmd, _cmds[cmd_num].cmd);
+  inMsg["cmd"] = incomingBuffer.strdup(cmd);
+  inMsg["id"] = id;
+  if(arg[0] == '{'){
+    inMsg["arg"] = incomingBuffer.parseObject(arg);
+  }else if(arg_len){
+    inMsg["arg"] = (const char*)arg;
+  }
+  parse_us = micros() - start;
+  dispatch(cmd_num, id, inMsg, outMsg, false);
+  return true;
+}
+
+boolean CmdProcessor::canStream(uint8_t flags){
+  if(!(flags & CMD_STREAM) || inflightCount >= CMD_INFLIGHT_LENGTH) return false;
+  for(int i = 0; i < inflightCount; i++){
+    if(!(inflight[(inflightFirst + i) % CMD_INFLIGHT_LENGTH].flags & CMD_STREAM)) return false;
   }
   return true;
 }
 
+void CmdProcessor::completeAfter(uint16_t tag){
+  pendingTagged = true;
+  pendingTag = tag;
+}
+
+boolean CmdProcessor::currentTag(uint16_t &tag){
+  if(!inflightCount || !inflight[inflightFirst].tagged) return false;
+  tag = inflight[inflightFirst].tag;
+  return true;
+}
+
+void CmdProcessor::processQueue(){
+  QueuedCmd *next = queue.front();
+  if(next == NULL || (in_process && !canStream(next->flags))) return;
+
+  incomingBuffer.clear();
+  outgoingBuffer.clear();
+  JsonObject& outMsg = outgoingBuffer.createObject();
+  uint32_t start = micros();
+  JsonObject& inMsg = incomingBuffer.parseObject(next->msg);
+  parse_us = micros() - start;
+  runCmd(inMsg, outMsg, true);
+  queue.pop();
+}
+
+void CmdProcessor::cancelQueue(){
+  QueuedCmd *next;
+  while((next = queue.front()) != NULL){
+    DynamicJsonBuffer jsonBuffer;
+    JsonObject& outMsg = jsonBuffer.createObject();
+    outMsg["msg"] = "Command cancelled";
+    // not cached, so a command sent again after a stop runs
+    sendResponse("error", outMsg, *next->id);
+    queue.pop();
+  }
+}
+
+void CmdProcessor::completed(){
+  InFlightCmd &c = inflight[inflightFirst];
+  if(stats && c.cmd >= 0){
+    recordTime(stats[c.cmd].complete, micros() - c.accepted_us);
+  }
+  inflightFirst = (inflightFirst + 1) % CMD_INFLIGHT_LENGTH;
+  inflightCount--;
+  in_process = inflightCount > 0;
+}
+
 void CmdProcessor::sendComplete(){
   if(in_process){
-    in_process = false;
     DynamicJsonBuffer jsonBuffer;
     JsonObject& outMsg = jsonBuffer.createObject();
-    sendResponse("complete", outMsg, *current_id);
+    sendCompleteMSG(outMsg);
   }
 }
 
 void CmdProcessor::sendCompleteMSG(ArduinoJson::JsonObject &outMsg){
   if(in_process){
-    in_process = false;
-    sendResponse("complete", outMsg, *current_id);
+    InFlightCmd &c = inflight[inflightFirst];
+    size_t len = sendResponse("complete", outMsg, *c.id);
+    if(c.cached) responses.store(c.id, c.hash, outputBuffer, len);
+    completed();
   }
 }
 
-void CmdProcessor::sendResponse(const char status[], ArduinoJson::JsonObject &outMsg, const char &id){
+size_t CmdProcessor::sendResponse(const char status[], ArduinoJson::JsonObject &outMsg, const char &id){
   if(strlen(&id)){
     outMsg["id"] = &id;
   }
   outMsg["status"] = status;
 
+  // Nearly every response fits, so it's printed straight into the buffer. If
+  // it fills the buffer it may have been cut short, and only then is it
+  // measured.
+  size_t len = outMsg.printTo(outputBuffer, sizeof(outputBuffer));
+  if(len < sizeof(outputBuffer) - 1){
+    sendRaw(outputBuffer, len);
+    return len;
+  }
+  len = outMsg.measureLength();
+  if(len < sizeof(outputBuffer)){
+    sendRaw(outputBuffer, len);
+    return len;
+  }
+  // Too long for the buffer (e.g. a long wifi scan), so print it into one
+  // just for this message. The length returned is longer than the response
+  // cache takes, so it's never cached from outputBuffer.
+  char *msg = (char*)malloc(len + 1);
+  if(msg){
+    outMsg.printTo(msg, len + 1);
+    sendRaw(msg, len);
+    free(msg);
+  }else{
+    StaticJsonBuffer<JSON_OBJECT_SIZE(3)> errBuffer;
+    JsonObject& err = errBuffer.createObject();
+    err["msg"] = "Response too long";
+    if(strlen(&id)){
+      err["id"] = &id;
+    }
+    err["status"] = "error";
+    if(err.measureLength() < sizeof(outputBuffer)){
+      sendRaw(outputBuffer, err.printTo(outputBuffer, sizeof(outputBuffer)));
+    }
+  }
+  return len;
+}
+
+void CmdProcessor::sendRaw(const char *msg, size_t len){
   for(int i = 0; i< OUTPUT_HANDLER_COUNT; i++){
     if(outputHandlers[i] != NULL){
-      outputHandlers[i](outMsg);
+      outputHandlers[i](msg, len);
     }
   }
 }
@@ -137,3 +438,52 @@ void CmdProcessor::sendResponse(const char status[], ArduinoJson::JsonObject &ou
 void CmdProcessor::notify(const char id[], ArduinoJson::JsonObject &outMsg){
   sendResponse("notify", outMsg, *id);
 }
+
+void CmdProcessor::recordTime(uint16_t hist[], uint32_t us){
+  uint8_t bucket = 0;
+  uint32_t limit = 100;
+  while(bucket < CMD_STATS_BUCKETS - 1 && us >= limit){
+    bucket++;
+    limit *= 10;
+  }
+  if(hist[bucket] < 0xFFFF) hist[bucket]++;
+}
+
+// Records one run of a command: the parse time of the message it was run
+// from (a queued command is parsed again to run it), and its handler time.
+// Replies from the cache and commands that are queued or refused aren't runs.
+void CmdProcessor::recordRun(CmdStats *st, uint32_t handler_us){
+  if(!st) return;
+  recordTime(st->parse, parse_us);
+  // a batch is only parsed once, so only its first command is charged for it
+  parse_us = 0;
+  recordTime(st->handler, handler_us);
+  if(st->count < 0xFFFF) st->count++;
+}
+
+void CmdProcessor::addHistogram(ArduinoJson::JsonObject &msg, const char *key, const uint16_t hist[]){
+  JsonArray& arr = msg.createNestedArray(key);
+  for(int i = 0; i < CMD_STATS_BUCKETS; i++){
+    arr.add(hist[i]);
+  }
+}
+
+boolean CmdProcessor::sendStats(const char id[], const char *name){
+  boolean found = false;
+  for(int i = 0; stats && i < cmd_count; i++){
+    char cmd[CMD_NAME_LENGTH];
+    strcpy_P(cmd, _cmds[i].cmd);
+    if(name[0] ? strcmp(name, cmd) != 0 : stats[i].count == 0) continue;
+    found = true;
+    DynamicJsonBuffer jsonBuffer;
+    JsonObject& outMsg = jsonBuffer.createObject();
+    JsonObject& msg = outMsg.createNestedObject("msg");
+    msg["cmd"] = cmd;
+    msg["count"] = stats[i].count;
+    addHistogram(msg, "parse", stats[i].parse);
+    addHistogram(msg, "handler", stats[i].handler);
+    addHistogram(msg, "complete", stats[i].complete);
+    notify(id, outMsg);
+  }
+  return found || !name[0];
+}
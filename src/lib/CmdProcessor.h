@@ -6,48 +6,165 @@
 class Evebrain;
 class CmdProcessor;
 
-#include "Evebrain.h"
 #include "./lib/ArduinoJson/ArduinoJson.h"
+#include "./lib/CmdQueue.h"
+#include "./lib/ResponseCache.h"
+#include "./lib/JsonArena.h"
 
-#define CMD_COUNT 52
+// Long enough for the longest command name ("digitalStopNotify") plus the terminator
+#define CMD_NAME_LENGTH 18
 #define JSON_BUFFER_LENGTH 550
+// Parsed messages are sized for the largest command, setConfig: cmd, id and an
+// arg object with up to 16 settings. JSON strings are parsed in place so need no
+// room, but the strings from a binary frame are copied in (plus the command name).
+#define JSON_SINGLE_BUFFER_LENGTH (JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(16) + BINARY_FRAME_MAX_LENGTH + CMD_NAME_LENGTH + 8)
+// Most commands that can be sent in one batch message
+#define CMD_BATCH_LENGTH 8
+// A batch is an array (optionally wrapped in {"cmds": ...}) of cmd, id and arg
+// objects, where the arg may be a small object as used by pinServo
+#define JSON_BATCH_BUFFER_LENGTH (JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(CMD_BATCH_LENGTH) + CMD_BATCH_LENGTH * (JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(3)))
+#define JSON_IN_BUFFER_LENGTH (JSON_SINGLE_BUFFER_LENGTH > JSON_BATCH_BUFFER_LENGTH ? JSON_SINGLE_BUFFER_LENGTH : JSON_BATCH_BUFFER_LENGTH)
+// Responses are sized for the largest reply, getConfig: msg, id and status, a msg
+// object with 17 values and four IP address strings copied into the buffer.
+#define JSON_OUT_BUFFER_LENGTH (JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(17) + 4 * 16)
 #define OUTPUT_HANDLER_COUNT 2
+// Marks the start of a binary command frame on the serial port
+#define BINARY_FRAME_START 0x02
+#define BINARY_FRAME_MAX_LENGTH 255
+
+// Command flags
+// Runs to completion straight away, no accepted/complete pair
+#define CMD_IMMEDIATE 0x01
+// Must never wait behind other commands or work (stop, pause, resume)
+#define CMD_PRIORITY  0x02
+// A move that's queued in the motors' segment buffer, so it can start while the
+// moves before it are still going and complete as soon as its own part is done
+#define CMD_STREAM    0x04
+// Sent over and over (drive), so it would soon push everything else out of the
+// response cache. Running it again when it's resent does no harm.
+#define CMD_NOCACHE   0x08
+
+// Most moves that can be in progress at once. Each one takes one segment, but
+// drive and slack calibration queue segments of their own, so a move can still
+// find the segment buffer full and be refused.
+#define CMD_INFLIGHT_LENGTH 4
+
+// Timing histograms count durations in decades: under 100us, 1ms, 10ms,
+// 100ms, 1s, and 1s or more
+#define CMD_STATS_BUCKETS 6
 
 typedef void (Evebrain::*EvebrainMemFn)(ArduinoJson::JsonObject &, ArduinoJson::JsonObject &);
 typedef void (* fp) (void *, char *);
 typedef boolean (* fp_ready) (void *);
-typedef void (* jsonMsgHandler) (ArduinoJson::JsonObject &);
+// Output handlers are given each response already serialised, so that it is
+// only printed once however many transports are enabled
+typedef void (* msgHandler) (const char *, size_t);
 
+// Command table entries are stored in flash (PROGMEM), sorted by name so
+// that they can be looked up with a binary search.
 struct Cmd {
-  const char *cmd;
+  char cmd[CMD_NAME_LENGTH];
   EvebrainMemFn func;
-  bool immediate;
+  uint8_t flags;
+  // Identifies the command in binary frames
+  uint8_t opcode;
+};
+
+struct CmdStats {
+  uint16_t count;
+  // Time taken to parse the message the command arrived in
+  uint16_t parse[CMD_STATS_BUCKETS];
+  // Time spent in the command's handler
+  uint16_t handler[CMD_STATS_BUCKETS];
+  // Time from accepted to complete, for commands that take time to run
+  uint16_t complete[CMD_STATS_BUCKETS];
+};
+
+// A command that has been accepted but not completed
+struct InFlightCmd {
+  char id[CMD_ID_LENGTH];
+  uint32_t hash;
+  // Its complete is cached for a retry, unless it was answered with an error
+  boolean cached;
+  int cmd;
+  uint8_t flags;
+  uint32_t accepted_us;
+  // Streamed moves complete when this motion segment has finished
+  boolean tagged;
+  uint16_t tag;
 };
 
 class CmdProcessor {
   public:
     CmdProcessor();
-    void addCmd(const char cmd[], EvebrainMemFn func, bool immediate);
-    bool addOutputHandler(jsonMsgHandler);
+    void setCmds(const Cmd cmds[], int count);
+    bool addOutputHandler(msgHandler);
     void process();
     void notify(const char[], ArduinoJson::JsonObject &);
     void setEvebrain(Evebrain &);
     void sendComplete();
     void sendCompleteMSG(ArduinoJson::JsonObject &);
+    // Handles a single JSON command, or a batch of them either as an array
+    // or as {"cmds": [...]}. Each command in a batch gets its own responses.
     boolean processMsg(char * msg);
+    // Handles a compact binary frame: opcode, id length, id, arg length, arg.
+    // The arg is the same text as the JSON "arg" string, or a JSON object.
+    boolean processBinaryMsg(const uint8_t * msg, size_t len);
+    // Starts the next queued command once the one in progress has completed
+    void processQueue();
+    // Drops all queued commands, sending an error for each of them
+    void cancelQueue();
+    // Called from the handler of a CMD_STREAM command that has queued a move:
+    // it completes once the segment with this sequence number has finished
+    void completeAfter(uint16_t tag);
+    // The segment the oldest command in progress is waiting on, if it's a move
+    boolean currentTag(uint16_t &tag);
+    // Sends the statistics for the named command, or for every command that
+    // has been used when name is empty, as one notify message per command
+    boolean sendStats(const char id[], const char *name);
     boolean in_process;
   private:
     boolean processLine();
+    int findCmd(const char *cmd);
+    int findOpcode(uint8_t opcode);
+    // Command number + 1 for each opcode up to maxOpcode, 0 where there's none
+    uint8_t *opcodeIndex;
+    uint8_t maxOpcode;
+    char* copyString(const uint8_t *src, size_t len);
+    void dispatch(int cmd_num, const char *id, ArduinoJson::JsonObject &inMsg, ArduinoJson::JsonObject &outMsg, bool fromQueue);
     void processCmd(const char &cmd, const char &arg, const char &id);
-    void runCmd(char &cmd, char &arg, char &id);
-    void sendResponse(const char state[], ArduinoJson::JsonObject &, const char &id);
+    void runCmd(ArduinoJson::JsonObject &inMsg, ArduinoJson::JsonObject &outMsg, bool fromQueue);
+    void runBatch(ArduinoJson::JsonArray &cmds);
+    size_t sendResponse(const char state[], ArduinoJson::JsonObject &, const char &id);
+    void sendRaw(const char *msg, size_t len);
+    void completed();
+    boolean canStream(uint8_t flags);
+    static void recordTime(uint16_t hist[], uint32_t us);
+    void recordRun(CmdStats *st, uint32_t handler_us);
+    static void addHistogram(ArduinoJson::JsonObject &, const char *key, const uint16_t hist[]);
     char webSocketKey[61];
-    char current_id[11];
+    // Oldest first; more than one only while moves are streaming
+    InFlightCmd inflight[CMD_INFLIGHT_LENGTH];
+    uint8_t inflightFirst;
+    uint8_t inflightCount;
+    boolean pendingTagged;
+    uint16_t pendingTag;
+    CmdQueue queue;
+    // Lets a command that's sent again after a reconnect be answered, rather than run twice
+    ResponseCache responses;
+    // Reused for every message instead of putting two buffers on the stack
+    JsonArena<JSON_IN_BUFFER_LENGTH> incomingBuffer;
+    JsonArena<JSON_OUT_BUFFER_LENGTH> outgoingBuffer;
     boolean processJSON();
     Evebrain* _m;
-    Cmd _cmds[CMD_COUNT];
-    int cmd_counter;
-    jsonMsgHandler outputHandlers[OUTPUT_HANDLER_COUNT];
+    const Cmd *_cmds;
+    int cmd_count;
+    // One per command in the table, allocated by setCmds
+    CmdStats *stats;
+    // Parse time of the current message, recorded against the next command run
+    uint32_t parse_us;
+    msgHandler outputHandlers[OUTPUT_HANDLER_COUNT];
+    char outputBuffer[JSON_BUFFER_LENGTH];
 };
 
 
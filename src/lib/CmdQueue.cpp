@@ -0,0 +1,50 @@
+#include "CmdQueue.h"
+
+CmdQueue::CmdQueue() {
+}
+
+bool CmdQueue::push(const char id[], uint32_t hash, ArduinoJson::JsonObject &msg, uint8_t flags) {
+    if (full() || msg.measureLength() >= CMD_QUEUE_MSG_LENGTH) {
+        return false;
+    }
+    QueuedCmd &slot = cmds[(numElements + firstIndex) % CMD_QUEUE_LENGTH];
+    strncpy(slot.id, id, CMD_ID_LENGTH - 1);
+    slot.id[CMD_ID_LENGTH - 1] = 0;
+    slot.hash = hash;
+    slot.flags = flags;
+    msg.printTo(slot.msg, CMD_QUEUE_MSG_LENGTH);
+    numElements++;
+    return true;
+}
+
+QueuedCmd* CmdQueue::front() {
+    if (numElements == 0) {
+        return NULL;
+    }
+    return &cmds[firstIndex];
+}
+
+QueuedCmd* CmdQueue::find(const char id[]) {
+    for (int i = 0; i < numElements; i++) {
+        QueuedCmd &cmd = cmds[(firstIndex + i) % CMD_QUEUE_LENGTH];
+        if (strncmp(cmd.id, id, CMD_ID_LENGTH - 1) == 0) {
+            return &cmd;
+        }
+    }
+    return NULL;
+}
+
+void CmdQueue::pop() {
+    if (numElements > 0) {
+        firstIndex = (firstIndex + 1) % CMD_QUEUE_LENGTH;
+        numElements--;
+    }
+}
+
+int CmdQueue::numberOfElements() {
+    return numElements;
+}
+
+bool CmdQueue::full() {
+    return numElements == CMD_QUEUE_LENGTH;
+}
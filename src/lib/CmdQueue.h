@@ -0,0 +1,45 @@
+#ifndef __CmdQueue_h__
+#define __CmdQueue_h__
+
+#include "Arduino.h"
+#include "./lib/ArduinoJson/ArduinoJson.h"
+
+#define CMD_QUEUE_LENGTH 8
+// Room for the longest command that waits in the queue as it's printed again:
+// speedMove with a 10 character id and four numbers of up to 20 characters,
+// as JavaScript prints them (-0.30000000000000004), takes 185
+#define CMD_QUEUE_MSG_LENGTH 192
+#define CMD_ID_LENGTH 11
+
+struct QueuedCmd {
+  char id[CMD_ID_LENGTH];
+  // The command's ResponseCache hash, to spot it being sent again while it waits
+  uint32_t hash;
+  // The command's flags, so it's known whether it can start before the one in progress completes
+  uint8_t flags;
+  // The command, serialised again so that it can be parsed when it is run
+  char msg[CMD_QUEUE_MSG_LENGTH];
+};
+
+/**
+ * FIFO of non-immediate commands waiting for the command in progress to
+ * complete. O(1) to push and pop.
+ */
+class CmdQueue {
+public:
+    CmdQueue();
+    // Returns false if the queue is full or the message is too long to store.
+    bool push(const char id[], uint32_t hash, ArduinoJson::JsonObject &msg, uint8_t flags);
+    // The oldest command in the queue, or NULL if it's empty.
+    QueuedCmd* front();
+    // The queued command with this id, or NULL if there isn't one.
+    QueuedCmd* find(const char id[]);
+    void pop();
+    int numberOfElements();
+    bool full();
+private:
+    QueuedCmd cmds[CMD_QUEUE_LENGTH];
+    int numElements = 0, firstIndex = 0;
+};
+
+#endif
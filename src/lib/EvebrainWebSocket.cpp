@@ -26,9 +26,15 @@ void onEventCallback(WebsocketsClient& client, WebsocketsEvent event, WSInterfac
 
 
 dataHandler handler = NULL;
+binaryDataHandler binaryHandler = NULL;
 
 void onMessageCallback(WebsocketsMessage message) {
-  if (handler) handler((char*) message.c_str());
+  if (message.isBinary()) {
+    // binary frames carry the compact command encoding
+    if (binaryHandler) binaryHandler((const uint8_t*) message.c_str(), message.length());
+  } else if (handler) {
+    handler((char*) message.c_str());
+  }
 }
 
 void beginWebSocket(){
@@ -64,11 +70,13 @@ void setWsMsgHandler(dataHandler h){
   handler = h;
 }
 
-void sendWsMsg(ArduinoJson::JsonObject &msg){
-  char jsonBuff[JSON_BUFFER_LENGTH];
-  msg.printTo(jsonBuff, sizeof(jsonBuff));
+void setWsBinaryMsgHandler(binaryDataHandler h){
+  binaryHandler = h;
+}
+
+void sendWsMsg(const char *msg, size_t len){
   if (wsClient.available()) {
-    wsClient.send(jsonBuff, strlen(jsonBuff));
+    wsClient.send(msg, len);
   }
 }
 
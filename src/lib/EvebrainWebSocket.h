@@ -7,10 +7,12 @@
 #include "lib/EvebrainWifi.h"
 
 typedef void (* dataHandler) (char *);
+typedef void (* binaryDataHandler) (const uint8_t *, size_t);
 
 void beginWebSocket();
 void setWsMsgHandler(dataHandler);
-void sendWsMsg(ArduinoJson::JsonObject &);
+void setWsBinaryMsgHandler(binaryDataHandler);
+void sendWsMsg(const char *, size_t);
 void websocketPoll();
 
 #endif
@@ -58,6 +58,10 @@ void EvebrainWifi::onMsg(dataHandler h){
   setWsMsgHandler(h);
 }
 
+void EvebrainWifi::onBinaryMsg(binaryDataHandler h){
+  setWsBinaryMsgHandler(h);
+}
+
 void EvebrainWifi::defautAPName(char *name){
   uint8_t mac[6];
   WiFi.softAPmacAddress(mac);
@@ -148,8 +152,8 @@ void EvebrainWifi::staCheck(){
   }
 }
 
-void EvebrainWifi::sendWebSocketMsg(ArduinoJson::JsonObject &outMsg){
-  sendWsMsg(outMsg);
+void EvebrainWifi::sendWebSocketMsg(const char *msg, size_t len){
+  sendWsMsg(msg, len);
 }
 
 #endif
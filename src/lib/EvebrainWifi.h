@@ -13,6 +13,7 @@
 #include "lib/ArduinoJson/ArduinoJson.h"
 
 typedef void (* dataHandler) (char *);
+typedef void (* binaryDataHandler) (const uint8_t *, size_t);
 
 struct EvebrainSettings;
 
@@ -32,7 +33,8 @@ class EvebrainWifi {
     static EvebrainSettings * settings;
     void getWifiScanData(ArduinoJson::JsonArray &);
     void onMsg(dataHandler);
-    static void sendWebSocketMsg(ArduinoJson::JsonObject &);
+    void onBinaryMsg(binaryDataHandler);
+    static void sendWebSocketMsg(const char *, size_t);
   private:
     bool enabled;
     static bool wifiScanRequested;
@@ -0,0 +1,35 @@
+#ifndef __JsonArena_h__
+#define __JsonArena_h__
+
+#include "./lib/ArduinoJson/ArduinoJson.h"
+
+/**
+ * A fixed size JsonBuffer that can be emptied and reused. Unlike a
+ * StaticJsonBuffer it's meant to be allocated once (statically) rather than
+ * on the stack for every message, which matters with the ESP8266's 4KB stack.
+ */
+template <size_t CAPACITY>
+class JsonArena : public ArduinoJson::JsonBuffer {
+  public:
+    JsonArena() : _size(0) {}
+
+    size_t capacity() const { return CAPACITY; }
+    size_t size() const { return _size; }
+
+    // Forgets everything that was allocated. Any JsonObject or JsonArray
+    // created from the arena must not be used after this.
+    void clear() { _size = 0; }
+
+    virtual void* alloc(size_t bytes) {
+      if (_size + bytes > CAPACITY) return NULL;
+      void* p = &_buffer[_size];
+      _size += round_size_up(bytes);
+      return p;
+    }
+
+  private:
+    uint8_t _buffer[CAPACITY];
+    size_t _size;
+};
+
+#endif
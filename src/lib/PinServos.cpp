@@ -1,7 +1,126 @@
 #include "PinServos.h"
 #include "Arduino.h"
 
-ManualServo::ManualServo():pin(-1), angle(0), running(false), nextServoPulse(0) {
+ServoPulses::Channel ServoPulses::channels[NUMBER_OF_SERVO_PINS];
+uint8_t ServoPulses::order[NUMBER_OF_SERVO_PINS];
+uint32_t ServoPulses::ends[NUMBER_OF_SERVO_PINS];
+uint8_t ServoPulses::pulses = 0;
+uint8_t ServoPulses::ended = 0;
+volatile uint16_t ServoPulses::high = 0;
+uint32_t ServoPulses::frameStart;
+volatile bool ServoPulses::timerRunning = false;
+
+bool ServoPulses::start(int pin, unsigned int widthUs, unsigned int count) {
+    int index = PinServos::servoPinToIndex(pin);
+    if (index == -1) {
+        return false;
+    }
+    pinMode(pin, OUTPUT);
+    noInterrupts();
+    channels[index].width = widthUs;
+    channels[index].count = count;
+    channels[index].running = true;
+    interrupts();
+    if (!timerRunning) {
+        startTimer();
+    }
+    return true;
+}
+
+void ServoPulses::stop(int pin) {
+    int index = PinServos::servoPinToIndex(pin);
+    if (index == -1) {
+        return;
+    }
+    noInterrupts();
+    channels[index].running = false;
+    // cut short a pulse in progress
+    if (high & (1 << index)) {
+        high &= ~(1 << index);
+        digitalWrite(pin, LOW);
+    }
+    interrupts();
+}
+
+unsigned int ServoPulses::pulsesLeft(int pin) {
+    int index = PinServos::servoPinToIndex(pin);
+    if (index == -1 || !channels[index].running) {
+        return 0;
+    }
+    return channels[index].count;
+}
+
+bool ServoPulses::isRunning(int pin) {
+    int index = PinServos::servoPinToIndex(pin);
+    return index != -1 && channels[index].running;
+}
+
+void ServoPulses::startTimer() {
+    timerRunning = true;
+    pulses = ended = 0;
+    timer0_isr_init();
+    timer0_attachInterrupt(onTimer);
+    // start the first frame straight away
+    frameStart = ESP.getCycleCount() + clockCyclesPerMicrosecond() * 10;
+    timer0_write(frameStart);
+}
+
+void ICACHE_RAM_ATTR ServoPulses::startFrame() {
+    const uint32_t cyclesPerUs = clockCyclesPerMicrosecond();
+    frameStart = ESP.getCycleCount();
+    pulses = ended = 0;
+    // raise every running pin together, keeping them sorted by width
+    for (int i = 0; i < NUMBER_OF_SERVO_PINS; i++) {
+        if (!channels[i].running) {
+            continue;
+        }
+        digitalWrite(PinServos::validPins[i], HIGH);
+        high |= 1 << i;
+        uint32_t end = frameStart + channels[i].width * cyclesPerUs;
+        int j = pulses++;
+        for (; j > 0 && (int32_t)(ends[j - 1] - end) > 0; j--) {
+            order[j] = order[j - 1];
+            ends[j] = ends[j - 1];
+        }
+        order[j] = i;
+        ends[j] = end;
+    }
+}
+
+void ICACHE_RAM_ATTR ServoPulses::onTimer() {
+    const uint32_t cyclesPerUs = clockCyclesPerMicrosecond();
+    if (ended == pulses) {
+        startFrame();
+        if (!pulses) {
+            timer0_detachInterrupt();
+            timerRunning = false;
+            return;
+        }
+    } else {
+        // end every pulse that's due, and any due in the next moment
+        uint32_t now = ESP.getCycleCount() + SERVO_END_SLOP_US * cyclesPerUs;
+        while (ended < pulses && (int32_t)(ends[ended] - now) <= 0) {
+            int i = order[ended++];
+            if (high & (1 << i)) {
+                high &= ~(1 << i);
+                digitalWrite(PinServos::validPins[i], LOW);
+                Channel &c = channels[i];
+                if (c.count && !--c.count) {
+                    c.running = false;
+                }
+            }
+        }
+    }
+    // The compare only matches going forward, so a time that has already
+    // passed (held up by an NMI or a flash stall, say) would leave the pins
+    // high until the cycle count wraps. Anything that late happens soon instead.
+    uint32_t soon = ESP.getCycleCount() + 10 * cyclesPerUs;
+    // the next pulse to end, or else the start of the next frame
+    uint32_t next = ended < pulses ? ends[ended] : frameStart + SERVO_FRAME_US * cyclesPerUs;
+    timer0_write((int32_t)(next - soon) > 0 ? next : soon);
+}
+
+ManualServo::ManualServo():pin(-1), angle(0), running(false) {
 
 }
 
@@ -9,46 +128,39 @@ void ManualServo::start(int pin, int angle) {
     this->pin = pin;
     this->angle = angle;
     running = true;
-    nextServoPulse = micros();
+    ServoPulses::start(pin, map(angle, 0, 180, 500, 2500));
 }
 
 void ManualServo::stop() {
     running = false;
+    ServoPulses::stop(pin);
     if (pin == 10) {
-        // now done (running for more than the 1000ms)
+        // now done (held for long enough)
         // set the servo to stop, and pull pin 10 HIGH as a precaution
         digitalWrite(10, HIGH);
     }
 }
 
-void ManualServo::poll() {
-    if(running){
-        if(micros() >= nextServoPulse){
-            int highTime = map(angle, 0, 180, 500, 2500);
-            digitalWrite(pin, HIGH);
-            delayMicroseconds(highTime);
-            digitalWrite(pin, LOW);
-            nextServoPulse = micros() + (12000 - highTime);
-        }
-    }
-}
-
 bool ManualServo::isRunning() {
     return running;
 }
 
+bool PinServos::holdValid(long holdMs) {
+    return holdMs >= MIN_SERVO_HOLD && holdMs <= MAX_SERVO_HOLD;
+}
+
 bool PinServos::pinValidForServo(int pin) {
     return servoPinToIndex(pin) != -1;
 }
 
-bool PinServos::startServo(int angle, int pin) {
+bool PinServos::startServo(int angle, int pin, unsigned long holdMs) {
     angle = constrain(angle, 0, 180);
 
     int index = servoPinToIndex(pin);
     if (index != -1) {
-        pinMode(pin, OUTPUT);
         servos[index].start(pin, angle);
         timesStarted[index] = millis();
+        holdTimes[index] = holdMs;
         return true;
     } else {
         return false;
@@ -57,9 +169,8 @@ bool PinServos::startServo(int angle, int pin) {
 
 void PinServos::poll() {
     for (int i = 0; i < NUMBER_OF_SERVO_PINS; i++) {
-        servos[i].poll();
         if (servos[i].isRunning() &&
-            millis() - timesStarted[i] >= MILLIS_BEFORE_STOP) {
+            millis() - timesStarted[i] >= holdTimes[i]) {
             servos[i].stop();
         }
     }
@@ -77,4 +188,4 @@ int PinServos::servoPinToIndex(int pin) {
 int PinServos::validPins[NUMBER_OF_SERVO_PINS] = {0, 2, 4, 5, 10, 16, 14, 12, 13};
 ManualServo PinServos::servos[NUMBER_OF_SERVO_PINS] = {ManualServo(), ManualServo(), ManualServo(), ManualServo(),
                                                     ManualServo(), ManualServo(), ManualServo(), ManualServo(), ManualServo()};
-unsigned long PinServos::timesStarted[NUMBER_OF_SERVO_PINS] = {0};
\ No newline at end of file
+unsigned long PinServos::timesStarted[NUMBER_OF_SERVO_PINS] = {0};unsigned long PinServos::holdTimes[NUMBER_OF_SERVO_PINS] = {0};
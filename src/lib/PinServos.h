@@ -1,18 +1,63 @@
 #ifndef GENERIC_SERVO_H
 #define GENERIC_SERVO_H
 
+#include "Arduino.h"
+
 // The number of servos that can be driven 'normally'
 #define NUMBER_OF_SERVO_PINS 9
+// How long a pin servo is held at its angle before it's let go, in ms
+#define DEFAULT_SERVO_HOLD 1000
+#define MIN_SERVO_HOLD 100
+#define MAX_SERVO_HOLD 60000
+// Each servo gets one pulse this often, in microseconds
+#define SERVO_FRAME_US 20000
+// Pulses ending this close together are ended by the same interrupt
+#define SERVO_END_SLOP_US 2
+
+// Sends servo pulses in the background from timer0 (timer1 drives the
+// steppers). Every frame starts all the pulses together, then the timer
+// interrupts at each pulse's end in order of width, so nine servos take
+// at most ten short interrupts a frame and nothing waits for a pulse.
+class ServoPulses {
+public:
+    // Sends a pulse of widthUs to the pin every frame, count times or until
+    // stopped if count is 0. Returns false if the pin can't be used.
+    static bool start(int pin, unsigned int widthUs, unsigned int count = 0);
+    static void stop(int pin);
+    // Pulses still to send, or 0 once they're done (or it's been stopped)
+    static unsigned int pulsesLeft(int pin);
+    static bool isRunning(int pin);
+
+private:
+    static void onTimer();
+    static void startTimer();
+    static void startFrame();
+    struct Channel {
+        volatile unsigned int width;
+        // 0 for no end
+        volatile unsigned int count;
+        volatile bool running;
+    };
+    static Channel channels[NUMBER_OF_SERVO_PINS];
+    // This frame's pulses, shortest first, and when each one ends
+    static uint8_t order[NUMBER_OF_SERVO_PINS];
+    static uint32_t ends[NUMBER_OF_SERVO_PINS];
+    static uint8_t pulses;
+    // How many of them have ended so far
+    static uint8_t ended;
+    // Channels that went high this frame and haven't been ended yet
+    static volatile uint16_t high;
+    static uint32_t frameStart;
+    static volatile bool timerRunning;
+};
 
 class ManualServo {
 public:
     ManualServo();
     void start(int pin, int angle);
     void stop();
-    void poll();
     bool isRunning();
 private:
-    unsigned long nextServoPulse;
     int angle;
     int pin;
     bool running;
@@ -22,20 +67,25 @@ class PinServos
 {
 public:
     // This allows for servos to be used with the other GPIO pins on the board
+    // The servo is held at the angle for holdMs, then let go.
     // Returns true if pin is valid and was able to start the servo, false otherwise.
-    static bool startServo(int angle, int pin);
+    static bool startServo(int angle, int pin, unsigned long holdMs = DEFAULT_SERVO_HOLD);
+    // Whether a servo can be held for this long, in ms (MIN_SERVO_HOLD to MAX_SERVO_HOLD).
+    // Checked wherever a hold time comes from, the settings or a command.
+    static bool holdValid(long holdMs);
     // Returns true if the pin can be used to control a servo.
     static bool pinValidForServo(int pin);
     // Must call this function in a loop to ensure the servo will be stopped after a time
     static void poll();
 
 private:
+    friend class ServoPulses;
     static int servoPinToIndex(int pin);
     // These members are all for the 9 pins that can be driven
     static int validPins[NUMBER_OF_SERVO_PINS];
     static ManualServo servos[NUMBER_OF_SERVO_PINS];
     static unsigned long timesStarted[NUMBER_OF_SERVO_PINS];
-    static const int MILLIS_BEFORE_STOP = 1000;
+    static unsigned long holdTimes[NUMBER_OF_SERVO_PINS];
 };
 
-#endif
\ No newline at end of file
+#endif
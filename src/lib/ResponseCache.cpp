@@ -0,0 +1,86 @@
+#include "ResponseCache.h"
+
+#define FNV_OFFSET 2166136261UL
+#define FNV_PRIME 16777619UL
+
+// Hashes whatever is printed to it (FNV-1a), so a message can be hashed
+// without serialising it into a buffer first
+class HashPrint : public Print {
+public:
+    uint32_t h = FNV_OFFSET;
+    size_t write(uint8_t c) {
+        h = (h ^ c) * FNV_PRIME;
+        return 1;
+    }
+    // The string and the null that ends it, so fields can't run together
+    void add(const char *s) {
+        while (*s) write(*s++);
+        write(0);
+    }
+    void add(ArduinoJson::JsonVariant value) {
+        // numbers and strings are both kept as the text they were parsed from
+        const char *s = value.asString();
+        if (s) {
+            add(s);
+        } else if (value.is<ArduinoJson::JsonObject&>()) {
+            for (ArduinoJson::JsonObject::iterator it = value.asObject().begin(); it != value.asObject().end(); ++it) {
+                add(it->key);
+                add(it->value);
+            }
+        } else {
+            value.printTo(*this);
+            write(0);
+        }
+    }
+};
+
+ResponseCache::ResponseCache() {
+    memset(entries, 0, sizeof(entries));
+}
+
+uint32_t ResponseCache::hash(const char *cmd, const char *id, ArduinoJson::JsonVariant arg) {
+    HashPrint p;
+    p.add(cmd);
+    p.add(id);
+    p.add(arg);
+    return p.h;
+}
+
+CachedResponse* ResponseCache::find(const char id[], uint32_t hash) {
+    for (int i = 0; i < RESPONSE_CACHE_LENGTH; i++) {
+        CachedResponse &e = entries[i];
+        if (e.id[0] && e.hash == hash && strncmp(e.id, id, CMD_ID_LENGTH - 1) == 0) {
+            if (millis() - e.time < RESPONSE_CACHE_MS) {
+                return &e;
+            }
+            e.id[0] = 0;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+void ResponseCache::store(const char id[], uint32_t hash, const char *msg, size_t len) {
+    CachedResponse *e = NULL;
+    for (int i = 0; i < RESPONSE_CACHE_LENGTH; i++) {
+        if (entries[i].id[0] && entries[i].hash == hash && strncmp(entries[i].id, id, CMD_ID_LENGTH - 1) == 0) {
+            e = &entries[i];
+            break;
+        }
+    }
+    if (len > RESPONSE_CACHE_MSG_LENGTH) {
+        // don't replay an earlier response in place of this one
+        if (e) e->id[0] = 0;
+        return;
+    }
+    if (!e) {
+        e = &entries[next];
+        next = (next + 1) % RESPONSE_CACHE_LENGTH;
+    }
+    strncpy(e->id, id, CMD_ID_LENGTH - 1);
+    e->id[CMD_ID_LENGTH - 1] = 0;
+    e->hash = hash;
+    e->time = millis();
+    e->len = len;
+    memcpy(e->msg, msg, len);
+}
@@ -0,0 +1,44 @@
+#ifndef __ResponseCache_h__
+#define __ResponseCache_h__
+
+#include "Arduino.h"
+#include "./lib/ArduinoJson/ArduinoJson.h"
+#include "./lib/CmdQueue.h"
+
+#define RESPONSE_CACHE_LENGTH 8
+// Longer responses (e.g. getConfig) aren't cached, so those commands simply run again
+#define RESPONSE_CACHE_MSG_LENGTH 80
+// Long enough to cover a websocket reconnect after the 11s pong timeout
+#define RESPONSE_CACHE_MS 30000
+
+struct CachedResponse {
+  char id[CMD_ID_LENGTH];
+  // Hash of the command and its arg, so a new command that happens to reuse an
+  // id (e.g. after the page is reloaded) isn't mistaken for a retry
+  uint32_t hash;
+  unsigned long time;
+  uint8_t len;
+  char msg[RESPONSE_CACHE_MSG_LENGTH];
+};
+
+/**
+ * Ring of the latest response sent for each of the last few commands, so a
+ * command that is sent again with the same id can be answered without
+ * running it twice.
+ */
+class ResponseCache {
+public:
+    ResponseCache();
+    // Hashes a command by its fields, as the parser (or a binary frame) left
+    // them, rather than printing the whole message again
+    static uint32_t hash(const char *cmd, const char *id, ArduinoJson::JsonVariant arg);
+    // The response for a matching command sent in the last RESPONSE_CACHE_MS, or NULL
+    CachedResponse* find(const char id[], uint32_t hash);
+    // Replaces any earlier response to the same command.
+    void store(const char id[], uint32_t hash, const char *msg, size_t len);
+private:
+    CachedResponse entries[RESPONSE_CACHE_LENGTH];
+    int next = 0;
+};
+
+#endif
@@ -50,10 +50,10 @@ processState_t SerialWebSocket::processHeaders(char * buffer, int len){
   return SERWS_HEADERS_NOT_PROCESSED;
 }
 
-void SerialWebSocket::send(ArduinoJson::JsonObject &outMsg){
+void SerialWebSocket::send(const char *msg, size_t len){
   _s->write(0x81);
-  _s->write(outMsg.measureLength() & B01111111);
-  outMsg.printTo(*_s);
+  _s->write(len & B01111111);
+  _s->write(msg, len);
 }
 
 processState_t SerialWebSocket::processWSFrame(char * buffer, int len){
@@ -25,7 +25,7 @@ class SerialWebSocket {
   public:
     SerialWebSocket(Stream &s);
     processState_t process(char *, int);
-    void send(ArduinoJson::JsonObject &);
+    void send(const char *, size_t);
   private:
     processState_t processWSFrame(char *, int);
     processState_t processHeaders(char *, int);
@@ -1,22 +1,70 @@
 #ifdef ESP8266
 #include "Arduino.h"
 #include "ShiftStepper.h"
+#include "SimplyAtomic/SimplyAtomic.h"
 
 ShiftStepper *ShiftStepper::firstInstance;
 int ShiftStepper::data_pin;
 int ShiftStepper::clock_pin;
 int ShiftStepper::latch_pin;
+boolean ShiftStepper::useSPI;
+boolean ShiftStepper::hardwareLatch;
 uint8_t ShiftStepper::lastBits;
 uint8_t ShiftStepper::currentBits;
+uint32_t ShiftStepper::accelPerTick;
+byte ShiftStepper::instanceCount;
+Segment ShiftStepper::segments[SEGMENT_BUFFER_LENGTH];
+Segment ShiftStepper::planned;
+Segment ShiftStepper::current;
+volatile boolean ShiftStepper::segmentActive;
+unsigned int ShiftStepper::slackSteps;
+volatile boolean ShiftStepper::slackPhase;
+volatile byte ShiftStepper::segmentHead;
+volatile byte ShiftStepper::segmentCount;
+volatile uint16_t ShiftStepper::queuedSeq;
+volatile uint16_t ShiftStepper::doneSeq;
+volatile boolean ShiftStepper::timerRunning;
+uint32_t ShiftStepper::interruptTicks;
+uint32_t ShiftStepper::dueCycle;
+StepperStats ShiftStepper::stats;
+
+// The half-step sequence for one motor, in the low four bits
+static constexpr uint8_t HALF_STEPS[8] = {
+  B0001, B0011, B0010, B0110, B0100, B1100, B1000, B1001
+};
+
+/**
+ * @brief Takes a byte, shifts it by a certain number of places,
+ * while wrapping around the bits that would normally fall off
+ * @param in Byte to process
+ * @param amountToShift Amount of places to shift (tested for positive only)
+ * @return byte The input byte, shifted.
+ */
+static byte shiftWraparound(byte in, int amountToShift) {
+  return in << amountToShift | in >> (8 - amountToShift);
+}
 
 ShiftStepper::ShiftStepper(int offset) {
   _remaining = 0;
-  _remainingInBatch = 0;
+  _position = 0;
+  _steps = 0;
   _paused = false;
-  motor_offset = offset;
-  currentStep = 0;
-  microCounter = UCOUNTER_DEFAULT;
-  cyclesToWait = 0;
+  _slackDir = lastDirection;
+  _slackOwed = 0;
+  // work out this motor's bits in the shift register up front
+  _mask = shiftWraparound(B1111, offset);
+  for(int i = 0; i < 8; i++){
+    _stepBits[i] = shiftWraparound(HALF_STEPS[i], offset);
+  }
+  _stepIndex = 0;
+  _stepDelta = 1;
+  _speed = 0x10000;
+  _cruiseRate = CRUISE_RATE;
+  _startRate = START_RATE;
+  _accel = 0;
+  _ahead = 0;
+  startRamp();
+  _index = instanceCount < SHIFTSTEPPER_MAX_MOTORS ? instanceCount++ : SHIFTSTEPPER_MAX_MOTORS - 1;
   release();
   if(firstInstance){
     firstInstance->addNext(this);
@@ -29,13 +77,29 @@ void ShiftStepper::setup(int _data_pin, int _clock_pin, int _latch_pin){
   data_pin  = _data_pin;
   clock_pin = _clock_pin;
   latch_pin = _latch_pin;
-  pinMode(data_pin,  OUTPUT);
-  pinMode(clock_pin, OUTPUT);
-  pinMode(latch_pin, OUTPUT);
+  // the latch is set through GPOS/GPOC, which only reach GPIO0-15
+  useSPI = data_pin == HSPI_DATA_PIN && clock_pin == HSPI_CLOCK_PIN && latch_pin < 16;
+  hardwareLatch = useSPI && latch_pin == HSPI_CS_PIN;
   pinMode(5, OUTPUT);
-  digitalWrite(data_pin,  LOW);
-  digitalWrite(clock_pin, LOW);
-  digitalWrite(latch_pin, LOW);
+  if(useSPI){
+    SPI.begin();
+    // chip select goes high at the end of each byte, which latches it
+    SPI.setHwCs(hardwareLatch);
+    SPI.setFrequency(SHIFT_REG_SPI_FREQUENCY);
+    SPI.setDataMode(SPI_MODE0);
+    SPI.setBitOrder(MSBFIRST);
+    // every transfer is one byte, so the length can be set once here
+    SPI1U1 = (SPI1U1 & ~(SPIMMOSI << SPILMOSI)) | (7 << SPILMOSI);
+  }else{
+    pinMode(data_pin,  OUTPUT);
+    pinMode(clock_pin, OUTPUT);
+    digitalWrite(data_pin,  LOW);
+    digitalWrite(clock_pin, LOW);
+  }
+  if(!hardwareLatch){
+    pinMode(latch_pin, OUTPUT);
+    digitalWrite(latch_pin, LOW);
+  }
   lastBits = 0;
   currentBits = 0;
   if(firstInstance){
@@ -44,7 +108,7 @@ void ShiftStepper::setup(int _data_pin, int _clock_pin, int _latch_pin){
 }
 
 void ShiftStepper::instanceSetup(){
-  currentStep = 0;
+  _stepIndex = 0;
   if(nextInstance){
     nextInstance->instanceSetup();
   }
@@ -63,44 +127,208 @@ void ShiftStepper::pause(){
 }
 
 void ShiftStepper::resume(){
-  _paused = false;
+  if(!_paused) return;
+  ATOMIC(){
+    // the motor has stopped, so it needs to accelerate again
+    startRamp();
+    _paused = false;
+  }
+}
+
+void ShiftStepper::setAcceleration(float stepsPerSecSq){
+  float tick = BASE_INTERRUPT_US / 1000000.0f;
+  accelPerTick = stepsPerSecSq > 0 ? stepsPerSecSq * tick * tick * 4294967296.0f : 0;
+}
+
+unsigned int ShiftStepper::fullSpeedPeriod(){
+  return accelPerTick ? DEFAULT_STEP_PERIOD : UNRAMPED_STEP_PERIOD;
+}
+
+void ICACHE_RAM_ATTR ShiftStepper::startRamp(){
+  _rate = _accel ? _startRate : _cruiseRate;
+  _phase = 0;
+  _rampSteps = 0;
 }
 
 void ShiftStepper::stop(){
-  _remaining = 0;
-  _remainingCyclesToSlowdown = 0;
-  setRelSpeed(1.0);
-  microCounter = UCOUNTER_DEFAULT;
+  ATOMIC(){
+    // drop everything queued, counting it as done so that nothing waits on it
+    boolean dropped = segmentActive || segmentCount;
+    segmentCount = 0;
+    if(dropped){
+      // the gears are left wherever the segment in progress got them to
+      replanSlack();
+    }
+    _remaining = 0;
+    segmentActive = false;
+    slackPhase = false;
+    doneSeq = queuedSeq;
+  }
+  _speed = 0x10000;
 }
 
 void ShiftStepper::turn(long steps, byte direction){
-  _remaining = steps;
-  if (cyclesToWait > 0) {
-    _remainingInBatch = _remaining < BATCH_SIZE ? _remaining : BATCH_SIZE;
+  plan(steps, direction);
+  queuePlanned();
+}
+
+void ShiftStepper::setSlack(unsigned int steps){
+  slackSteps = steps;
+}
+
+void ShiftStepper::planSlack(MotorMove &move){
+  if(move.dir == lastDirection){
+    move.slack = _slackOwed;
+  }else{
+    move.slack = slackSteps > _slackOwed ? slackSteps - _slackOwed : 0;
   }
-  //Serial.printf("Steps:%d\n", steps);
-  _dir = direction;
-  lastDirection = direction;
-  startTimer();
+  _slackOwed = 0;
+  lastDirection = move.dir;
 }
 
-boolean ShiftStepper::ready(){
-  return (_remaining == 0  && _remainingCyclesToSlowdown == 0);
+void ShiftStepper::replanSlack(){
+  for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+    m->lastDirection = m->_slackDir;
+    // while taking up slack, _remaining is the slack still to take up
+    m->_slackOwed = segmentActive && slackPhase ? m->_remaining : 0;
+    for(int i = 0; i < segmentCount; i++){
+      const MotorMove &move = segments[(segmentHead + i) % SEGMENT_BUFFER_LENGTH].moves[m->_index];
+      if(move.steps || move.slack){
+        m->lastDirection = move.dir;
+        m->_slackOwed = 0;
+      }
+    }
+  }
+}
+
+void ShiftStepper::plan(long steps, byte direction){
+  MotorMove &move = planned.moves[_index];
+  move.steps = steps;
+  move.dir = direction;
+  // lastDirection is the way the gears will be once the segments queued
+  // before this one have run
+  planSlack(move);
+  move.cruiseRate = ((uint64_t)(accelPerTick ? CRUISE_RATE : UNRAMPED_RATE) * _speed) >> 16;
+  move.startRate = ((uint64_t)START_RATE * _speed) >> 16;
+  move.accel = ((uint64_t)accelPerTick * _speed) >> 16;
+  // the speed only applies to this move
+  _speed = 0x10000;
 }
 
-boolean ShiftStepper::allStopped() {
-  if (!firstInstance) {
-    return true;
+boolean ShiftStepper::joins(const Segment &prev, const Segment &next){
+  for(int i = 0; i < instanceCount; i++){
+    const MotorMove &a = prev.moves[i], &b = next.moves[i];
+    if((a.steps > 0) != (b.steps > 0) || b.slack) return false;
+    if(b.steps > 0 && (a.dir != b.dir || a.cruiseRate != b.cruiseRate)) return false;
   }
-  if (!(firstInstance->ready())) {
-    return false;
+  return true;
+}
+
+boolean ShiftStepper::queuePlanned(){
+  boolean queued = false;
+  ATOMIC(){
+    if(segmentCount < SEGMENT_BUFFER_LENGTH){
+      Segment &seg = segments[(segmentHead + segmentCount) % SEGMENT_BUFFER_LENGTH];
+      seg = planned;
+      if(segmentCount){
+        seg.joins = joins(segments[(segmentHead + segmentCount - 1) % SEGMENT_BUFFER_LENGTH], seg);
+      }else{
+        seg.joins = segmentActive && joins(current, seg);
+      }
+      segmentCount++;
+      queuedSeq++;
+      updateAhead();
+      if(!timerRunning){
+        startTimer();
+      }
+      queued = true;
+    }
   }
-  ShiftStepper* next = firstInstance->nextInstance;
-  while (next != nullptr) {
-    if (!(next->ready())) {
+  memset(&planned, 0, sizeof(planned));
+  return queued;
+}
+
+void ShiftStepper::drivePlanned(){
+  ATOMIC(){
+    Segment &last = segments[(segmentHead + segmentCount + SEGMENT_BUFFER_LENGTH - 1) % SEGMENT_BUFFER_LENGTH];
+    if(segmentCount && last.drive){
+      // A change of direction waiting for the motors to stop, which this
+      // replaces. Nothing waits on drive segments, so its number can go again.
+      segmentCount--;
+      queuedSeq--;
+      // Its slack was never taken up, so plan the slack again without it
+      replanSlack();
+      for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+        MotorMove &move = planned.moves[m->_index];
+        if(move.steps){
+          m->planSlack(move);
+        }
+      }
+    }
+    // the motors that keep going the same way can change speed as they go
+    boolean inPlace = segmentActive && !slackPhase;
+    for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+      const MotorMove &move = planned.moves[m->_index];
+      if(move.steps && (!m->_remaining || m->_dir != move.dir)){
+        inPlace = false;
+      }
+    }
+    for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+      const MotorMove &move = planned.moves[m->_index];
+      if(inPlace && move.steps){
+        m->_remaining = move.steps;
+        m->_cruiseRate = move.cruiseRate;
+        m->_startRate = move.startRate;
+        m->_accel = move.accel;
+        if(!m->_accel){
+          m->_rate = m->_cruiseRate;
+        }
+      }else if(m->_remaining > m->_rampSteps){
+        // slow to a stop, as if the move ended here
+        m->_remaining = m->_rampSteps;
+      }
+    }
+    if(inPlace){
+      current = planned;
+      updateAhead();
+    }else if(segmentCount < SEGMENT_BUFFER_LENGTH){
+      // start again once the motors have stopped
+      Segment &seg = segments[(segmentHead + segmentCount) % SEGMENT_BUFFER_LENGTH];
+      seg = planned;
+      seg.joins = false;
+      seg.drive = true;
+      segmentCount++;
+      queuedSeq++;
+      updateAhead();
+      if(!timerRunning){
+        startTimer();
+      }
+    }
+  }
+  memset(&planned, 0, sizeof(planned));
+}
+
+uint16_t ShiftStepper::lastQueued(){
+  return queuedSeq;
+}
+
+boolean ShiftStepper::segmentDone(uint16_t seq){
+  return (int16_t)(doneSeq - seq) >= 0;
+}
+
+int ShiftStepper::segmentsFree(){
+  return SEGMENT_BUFFER_LENGTH - segmentCount;
+}
+
+boolean ShiftStepper::ready(){
+  return _remaining == 0 && segmentCount == 0;
+}
+
+boolean ICACHE_RAM_ATTR ShiftStepper::allStopped() {
+  for (ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance) {
+    if (m->_remaining) {
       return false;
     }
-    next = next->nextInstance;
   }
   return true;
 }
@@ -109,146 +337,273 @@ long ShiftStepper::remaining(){
   return _remaining;
 }
 
+long ShiftStepper::position(){
+  return _position;
+}
+
+uint32_t ShiftStepper::steps(){
+  return _steps;
+}
+
+void ShiftStepper::getStats(StepperStats &out){
+  ATOMIC(){
+    out = stats;
+  }
+}
+
+void ShiftStepper::resetStats(){
+  ATOMIC(){
+    memset(&stats, 0, sizeof(stats));
+    for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+      m->_steps = 0;
+    }
+  }
+}
+
 void ShiftStepper::setRelSpeed(float multiplier) {
-  if (multiplier >= 1.0 || multiplier < 0) {
-    cyclesToWait = 0;
+  if (multiplier >= 1.0 || multiplier <= 0) {
+    _speed = 0x10000;
   } else {
-    cyclesToWait = ((UCOUNTER_DEFAULT * BATCH_SIZE) / multiplier) - UCOUNTER_DEFAULT * BATCH_SIZE;
-  }
-}
-
-byte ICACHE_RAM_ATTR ShiftStepper::nextStep(){
-  switch(currentStep){
-    case B0000:
-    case B0001:
-      return (_dir == FORWARD ? B0011 : B1001);
-    case B0011:
-      return (_dir == FORWARD ? B0010 : B0001);
-    case B0010:
-      return (_dir == FORWARD ? B0110 : B0011);
-    case B0110:
-      return (_dir == FORWARD ? B0100 : B0010);
-    case B0100:
-      return (_dir == FORWARD ? B1100 : B0110);
-    case B1100:
-      return (_dir == FORWARD ? B1000 : B0100);
-    case B1000:
-      return (_dir == FORWARD ? B1001 : B1100);
-    case B1001:
-      return (_dir == FORWARD ? B0001 : B1000);
-    default:
-      return B0000;
-  }
-}
-
-void ICACHE_RAM_ATTR ShiftStepper::setNextStepSlowdown() {
-  if (_remainingInBatch > 0) {
-    // if in a batch, proceed as normal
-    if(_remaining > 0 && !_paused){
-      if(!--microCounter){
-        microCounter = UCOUNTER_DEFAULT;
-        _remaining--;
-        _remainingInBatch--; // decrement batch counter as well
-        updateBits(nextStep());
-      }
-    }
-    // if now done with the batch, start slowdown.
-    if (!_remainingInBatch) {
-      _remainingCyclesToSlowdown = cyclesToWait;
-    }
-  } else if (_remainingCyclesToSlowdown > 0) {
-    // if in a slowdown period
-    _remainingCyclesToSlowdown--;
-    // if now done with the slowdown, do next batch
-    if (!_remainingCyclesToSlowdown) {
-      _remainingInBatch = _remaining < BATCH_SIZE ? _remaining : BATCH_SIZE;
+    _speed = multiplier * 0x10000;
+    // never so slow that the motor doesn't move at all
+    if (!_speed) _speed = 1;
+  }
+}
+
+float ShiftStepper::getRelSpeed() {
+  return _speed / 65536.0f;
+}
+
+uint32_t ICACHE_RAM_ATTR ShiftStepper::rampedRate(uint32_t rate, boolean decelerating){
+  if(_accel){
+    if(decelerating){
+      return rate > _startRate + _accel ? rate - _accel : _startRate;
+    }else if(rate < _cruiseRate){
+      return _cruiseRate - rate > _accel ? rate + _accel : _cruiseRate;
+    }else if(rate > _cruiseRate){
+      // only when drivePlanned has slowed the move down
+      return rate - _cruiseRate > _accel ? rate - _accel : _cruiseRate;
     }
-  } else {
-    // if done moving
-    setRelSpeed(1.0);
-    if (allStopped()) {
-        release();
-        stopTimer();
+  }
+  return rate;
+}
+
+uint32_t ICACHE_RAM_ATTR ShiftStepper::ticksToStep(){
+  if(_remaining <= 0 || _paused){
+    return MAX_INTERRUPT_TICKS;
+  }
+  boolean decelerating = _remaining + _ahead <= _rampSteps;
+  if(rampedRate(_rate, decelerating) == _rate){
+    // the step is due on the tick that takes the phase past the top
+    uint32_t ticks = ~_phase / _rate + 1;
+    return ticks < MAX_INTERRUPT_TICKS ? ticks : MAX_INTERRUPT_TICKS;
+  }
+  uint32_t rate = _rate, phase = _phase;
+  for(uint32_t ticks = 1; ticks < MAX_INTERRUPT_TICKS; ticks++){
+    rate = rampedRate(rate, decelerating);
+    if(phase + rate < phase){
+      return ticks;
     }
+    phase += rate;
   }
+  return MAX_INTERRUPT_TICKS;
 }
 
-void ICACHE_RAM_ATTR ShiftStepper::setNextStepFullspeed() {
+void ICACHE_RAM_ATTR ShiftStepper::setNextStep(uint32_t ticks) {
   if(_remaining > 0 && !_paused){
-      if(!--microCounter){
-        microCounter = UCOUNTER_DEFAULT;
-        _remaining--;
-        updateBits(nextStep());
+      // Start slowing down once there are only as many steps left as it
+      // took to get up to speed, so the move ends at the start rate
+      boolean decelerating = _remaining + _ahead <= _rampSteps;
+      // a step is due each time the phase wraps around, which spaces the
+      // steps evenly (to within one tick) at any rate
+      boolean due = false;
+      if(rampedRate(_rate, decelerating) == _rate){
+        uint64_t phase = (uint64_t)_phase + (uint64_t)_rate * ticks;
+        _phase = phase;
+        due = phase >> 32;
+      }else{
+        for(; ticks && !due; ticks--){
+          _rate = rampedRate(_rate, decelerating);
+          uint32_t lastPhase = _phase;
+          _phase += _rate;
+          due = _phase < lastPhase;
+        }
       }
-    }else{
-      setRelSpeed(1.0); // makes sure that speed is normal on next move.
-      if (allStopped()) {
-        release();
-        stopTimer();
+      // The timer is set for the next step due, so this is the last of the
+      // ticks. A motor that resumed in between just steps late.
+      if(due){
+        if(!decelerating && _rate < _cruiseRate){
+          _rampSteps++;
+        }
+        _remaining--;
+        _steps++;
+        if(!slackPhase){
+          _position += _dir == FORWARD ? 1 : -1;
+        }
+        _stepIndex = (_stepIndex + _stepDelta) & 7;
+        currentBits = (currentBits & ~_mask) | _stepBits[_stepIndex];
       }
   }
 }
 
-void ICACHE_RAM_ATTR ShiftStepper::setNextStep(){
-  if (cyclesToWait > 0) { // if we are running slower than normal
-    setNextStepSlowdown();
-  } else {
-    setNextStepFullspeed();
+void ICACHE_RAM_ATTR ShiftStepper::updateAhead(){
+  for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+    m->_ahead = 0;
+  }
+  for(int i = 0; i < segmentCount; i++){
+    const Segment &seg = segments[(segmentHead + i) % SEGMENT_BUFFER_LENGTH];
+    if(!seg.joins) break;
+    for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+      m->_ahead += seg.moves[m->_index].steps;
+    }
   }
 }
 
-void ICACHE_RAM_ATTR ShiftStepper::release(){
-  currentStep = 0;
-  updateBits(0);
-  sendBits();
+void ICACHE_RAM_ATTR ShiftStepper::startSegment(){
+  current = segments[segmentHead];
+  segmentHead = (segmentHead + 1) % SEGMENT_BUFFER_LENGTH;
+  segmentCount--;
+  segmentActive = true;
+  slackPhase = false;
+  for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+    const MotorMove &move = current.moves[m->_index];
+    if(move.steps || move.slack){
+      m->_slackDir = move.dir;
+    }
+    m->_remaining = move.slack;
+    if(!move.slack) continue;
+    // the slack is taken up at the normal speed, whatever the move's speed
+    slackPhase = true;
+    m->_dir = move.dir;
+    m->_stepDelta = move.dir == FORWARD ? 1 : 7;
+    m->_cruiseRate = accelPerTick ? CRUISE_RATE : UNRAMPED_RATE;
+    m->_startRate = START_RATE;
+    m->_accel = accelPerTick;
+    m->_ahead = 0;
+    m->startRamp();
+  }
+  if(!slackPhase){
+    startMove();
+  }
 }
 
-void ICACHE_RAM_ATTR ShiftStepper::trigger(){
-  setNextStep();
-  if(nextInstance){
-    nextInstance->trigger();
+void ICACHE_RAM_ATTR ShiftStepper::startMove(){
+  slackPhase = false;
+  for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+    const MotorMove &move = current.moves[m->_index];
+    m->_remaining = move.steps;
+    if(!move.steps) continue;
+    m->_dir = move.dir;
+    m->_stepDelta = move.dir == FORWARD ? 1 : 7;
+    m->_cruiseRate = move.cruiseRate;
+    m->_startRate = move.startRate;
+    m->_accel = move.accel;
+    // a joining segment keeps the speed, phase and ramp of the one before
+    if(!current.joins){
+      m->startRamp();
+    }
   }
+  updateAhead();
 }
 
-/**
- * @brief Takes a byte, shifts it by a certain number of places,
- * while wrapping around the bits that would normally fall off
- * @param in Byte to process
- * @param amountToShift Amount of places to shift (tested for positive only)
- * @return byte The input byte, shifted.
- */
-byte shiftWraparound(byte in, int amountToShift) {
-  return in << amountToShift | in >> (8 - amountToShift);
+void ICACHE_RAM_ATTR ShiftStepper::release(){
+  // the next step starts the sequence again from the beginning
+  _stepIndex = 0;
+  currentBits &= ~_mask;
+  sendBits();
 }
 
-void ICACHE_RAM_ATTR ShiftStepper::updateBits(uint8_t bits){
-  currentStep = bits;
-  // clear upper 4 bits of 'bits'
-  bits &= B1111;
-  // Offset bits according to the motor.
-  bits = shiftWraparound(bits, motor_offset);
-  // clear the bits that correspond to this motor
-  currentBits &= ~(shiftWraparound(B1111, motor_offset));
-  // set the bits for this motor.
-  currentBits |= bits;
+void ICACHE_RAM_ATTR ShiftStepper::trigger(uint32_t ticks){
+  setNextStep(ticks);
+  if(nextInstance){
+    nextInstance->trigger(ticks);
+  }
 }
 
 void ICACHE_RAM_ATTR ShiftStepper::sendBits(){
   if(currentBits != lastBits){
     lastBits = currentBits;
-    shiftOut(data_pin, clock_pin, MSBFIRST, currentBits);
-    digitalWrite(latch_pin, HIGH);
-    digitalWrite(data_pin,  LOW);
-    digitalWrite(clock_pin, LOW);
-    digitalWrite(latch_pin, LOW);
+    if(useSPI){
+      // write the registers directly, as the SPI library isn't in IRAM
+      while(SPI1CMD & SPIBUSY){}
+      SPI1W0 = currentBits;
+      SPI1CMD |= SPIBUSY;
+      if(!hardwareLatch){
+        while(SPI1CMD & SPIBUSY){}
+        GPOS = 1 << latch_pin;
+        GPOC = 1 << latch_pin;
+      }
+    }else{
+      shiftOut(data_pin, clock_pin, MSBFIRST, currentBits);
+      digitalWrite(latch_pin, HIGH);
+      digitalWrite(data_pin,  LOW);
+      digitalWrite(clock_pin, LOW);
+      digitalWrite(latch_pin, LOW);
+    }
   }
 }
 
 void ICACHE_RAM_ATTR ShiftStepper::triggerTop(){
+  uint32_t start = ESP.getCycleCount();
+  const uint32_t tickCycles = clockCyclesPerMicrosecond() * BASE_INTERRUPT_US;
+  if((int32_t)(start - dueCycle) >= (int32_t)tickCycles){
+    stats.late++;
+  }
+  // every motor moves on by the ticks since the last interrupt
   if(firstInstance){
-    firstInstance->trigger();
+    firstInstance->trigger(interruptTicks);
+  }
+  // move straight on to the next segment once every motor has finished this one
+  if(allStopped() && slackPhase){
+    // all the slack is taken up, so the move itself can start
+    startMove();
+  }else if(allStopped()){
+    if(segmentActive){
+      segmentActive = false;
+      doneSeq++;
+    }
+    if(segmentCount){
+      startSegment();
+    }else if(currentBits != lastBits){
+      // send the last step, and release the motors a tick later
+    }else{
+      for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+        m->release();
+      }
+      stopTimer();
+    }
+  }
+  if(timerRunning){
+    scheduleNext();
   }
   sendBits();
+  uint32_t cycles = ESP.getCycleCount() - start;
+  stats.interrupts++;
+  stats.totalCycles += cycles;
+  if(cycles > stats.maxCycles){
+    stats.maxCycles = cycles;
+  }
+  if(cycles > tickCycles){
+    stats.overruns++;
+  }
+}
+
+void ICACHE_RAM_ATTR ShiftStepper::scheduleNext(){
+  uint32_t ticks = MAX_INTERRUPT_TICKS;
+  if(allStopped()){
+    // nothing to step in this segment, so move on to the next straight away
+    ticks = 1;
+  }else{
+    for(ShiftStepper *m = firstInstance; m != nullptr; m = m->nextInstance){
+      uint32_t t = m->ticksToStep();
+      if(t < ticks){
+        ticks = t;
+      }
+    }
+  }
+  interruptTicks = ticks;
+  timer1_write(clockCyclesPerMicrosecond() * BASE_INTERRUPT_US * ticks);
+  dueCycle = ESP.getCycleCount() + clockCyclesPerMicrosecond() * BASE_INTERRUPT_US * ticks;
 }
 
 void ShiftStepper::startTimer(){
@@ -256,12 +611,17 @@ void ShiftStepper::startTimer(){
   timer1_disable();
   timer1_isr_init();
   timer1_attachInterrupt(ShiftStepper::triggerTop);
-  timer1_enable(TIM_DIV1, TIM_EDGE, TIM_LOOP);
+  // each interrupt sets the timer for the next one
+  timer1_enable(TIM_DIV1, TIM_EDGE, TIM_SINGLE);
+  interruptTicks = 1;
   timer1_write(clockCyclesPerMicrosecond() * BASE_INTERRUPT_US);
+  dueCycle = ESP.getCycleCount() + clockCyclesPerMicrosecond() * BASE_INTERRUPT_US;
+  timerRunning = true;
 }
 
-void ShiftStepper::stopTimer(){
+void ICACHE_RAM_ATTR ShiftStepper::stopTimer(){
   timer1_disable();
+  timerRunning = false;
 }
 
 #endif
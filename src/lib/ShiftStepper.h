@@ -1,68 +1,221 @@
 #ifndef __ShiftStepper_h__
 #define __ShiftStepper_h__
 #include "Arduino.h"
+#include <SPI.h>
 
 #define FORWARD 1
 #define BACKWARD 0
 
+// Moves are timed in ticks of this length, but the timer only interrupts
+// when a step is due
 #define BASE_INTERRUPT_US 50
-#define DEFAULT_STEP_PERIOD 1500
-#define UCOUNTER_DEFAULT DEFAULT_STEP_PERIOD/BASE_INTERRUPT_US
+// Longest gap between interrupts, in ticks, so that a paused motor that
+// resumes doesn't wait long for its first step
+#define MAX_INTERRUPT_TICKS 64
+// Full speed, about 13.3rpm for the 28BYJ-48. Starting at this speed would
+// stall the motors, but they can get up to it on the ramp.
+#define DEFAULT_STEP_PERIOD 1100
 
-#define BATCH_SIZE 4
+// Moves ramp up from this step period to DEFAULT_STEP_PERIOD and back down again
+#define START_STEP_PERIOD 3000
+// With the ramp turned off the motors start straight at full speed, so full
+// speed is the slower one they can start at
+#define UNRAMPED_STEP_PERIOD 1500
+// Step rates are fractions of a step per timer trigger, in 0.32 fixed point, so
+// that the timer can step by adding the rate to a phase accumulator
+#define RATE_FROM_PERIOD(us) ((uint32_t)(((1ULL << 32) * BASE_INTERRUPT_US + (us) - 1) / (us)))
+#define CRUISE_RATE RATE_FROM_PERIOD(DEFAULT_STEP_PERIOD)
+#define START_RATE RATE_FROM_PERIOD(START_STEP_PERIOD)
+#define UNRAMPED_RATE RATE_FROM_PERIOD(UNRAMPED_STEP_PERIOD)
+
+// A shift register wired to the HSPI data and clock pins is written by the
+// HSPI peripheral rather than bit-banged. If its latch is on the HSPI chip
+// select pin as well, the peripheral latches it too.
+#define HSPI_DATA_PIN  13
+#define HSPI_CLOCK_PIN 14
+#define HSPI_CS_PIN    15
+#define SHIFT_REG_SPI_FREQUENCY 4000000
+
+// Moves waiting to start, after the one in progress
+#define SEGMENT_BUFFER_LENGTH 8
+// There's room in the shift register for two motors
+#define SHIFTSTEPPER_MAX_MOTORS 2
+
+// One motor's part of a segment, with its profile worked out when it's queued
+struct MotorMove {
+  long steps;
+  byte dir;
+  // Slack to take up first, as the motor has changed direction
+  unsigned int slack;
+  uint32_t cruiseRate;
+  uint32_t startRate;
+  uint32_t accel;
+};
+
+// A move of every motor at once. Any slack is taken up first, on all the motors
+// at the same time, then the move starts once they have all finished that.
+// The next segment starts as soon as all the motors have finished this one.
+struct Segment {
+  MotorMove moves[SHIFTSTEPPER_MAX_MOTORS];
+  // Carries on from the segment before without slowing down, as every motor
+  // keeps going in the same direction at the same speed
+  boolean joins;
+  // Queued by drivePlanned, so the next drive can take its place
+  boolean drive;
+};
+
+// How the timer interrupt has been keeping up, since boot or the last reset
+struct StepperStats {
+  uint32_t interrupts;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  // Interrupts that took longer than a tick
+  uint32_t overruns;
+  // Interrupts that came a tick or more after they were due, which holds up
+  // every step due in between
+  uint32_t late;
+};
 
 class ShiftStepper {
   public:
     ShiftStepper(int);
     static void setup(int, int, int);
     void instanceSetup();
+    // Queues a move of this motor on its own
     void turn(long steps, byte direction);
+    // Sets this motor's part of the next segment, at the speed given to setRelSpeed.
+    // If the direction has changed, the slack is taken up as part of it.
+    void plan(long steps, byte direction);
+    // Steps a motor takes to take up the slack in its gears when it changes direction
+    static void setSlack(unsigned int steps);
+    // Queues the planned segment to start the tick after the segments before
+    // it finish. Returns false if the segment buffer is full.
+    static boolean queuePlanned();
+    // Runs the planned segment in place of the one in progress (and anything
+    // queued after it), for driving at a speed that keeps changing. Motors
+    // that keep going the same way change speed without stopping; if any
+    // motor changes direction, they all slow to a stop first. Only a segment
+    // queued by drivePlanned is replaced, never one queued by queuePlanned.
+    static void drivePlanned();
+    // Sequence number of the last segment queued
+    static uint16_t lastQueued();
+    // Whether the segment with this sequence number has finished (or been stopped)
+    static boolean segmentDone(uint16_t seq);
+    static int segmentsFree();
+    // True when this motor has finished and nothing else is queued
     boolean ready();
     static boolean allStopped();
     long remaining();
+    // Steps taken since boot, counting up going FORWARD and down going BACKWARD.
+    // Slack takeup isn't counted, as the wheel doesn't move.
+    long position();
+    // Every step this motor has taken, slack takeup included
+    uint32_t steps();
+    static void getStats(StepperStats &out);
+    static void resetStats();
     void release();
     static void triggerTop();
+    // Acceleration and deceleration of every move, in steps/s^2 (0 for none)
+    static void setAcceleration(float stepsPerSecSq);
+    // Step period of a full speed move, in us, which is slower without the ramp
+    static unsigned int fullSpeedPeriod();
     void pause();
     void resume();
     void stop();
     byte lastDirection;
 
     // Sets the speed of the motor for the current move (must be <1); reset back to 1 next time.
+    // The speed has a resolution of 1/65536.
     void setRelSpeed(float multiplier);
     float getRelSpeed();
   private:
     static ShiftStepper *firstInstance;
     ShiftStepper *nextInstance;
+    static byte instanceCount;
+    // Where this motor's part of each segment is kept
+    byte _index;
     void addNext(ShiftStepper *ref);
+
+    static Segment segments[SEGMENT_BUFFER_LENGTH];
+    static Segment planned;
+    // The segment in progress, kept to see if the next one can join on to it
+    static Segment current;
+    static volatile boolean segmentActive;
+    static unsigned int slackSteps;
+    // Taking up slack before the move in the current segment
+    static volatile boolean slackPhase;
+    static volatile byte segmentHead;
+    static volatile byte segmentCount;
+    static volatile uint16_t queuedSeq;
+    static volatile uint16_t doneSeq;
+    static volatile boolean timerRunning;
+    // Ticks until the interrupt the timer is set for
+    static uint32_t interruptTicks;
+    // Cycle count the next interrupt is due at
+    static uint32_t dueCycle;
+    static StepperStats stats;
+    // Works out each motor's lastDirection again from the segment in progress
+    // and those still queued, after some of the queued ones have been dropped
+    static void replanSlack();
+    // Sets the slack to take up before a move, and the direction it leaves the gears
+    void planSlack(MotorMove &move);
+    static void scheduleNext();
+    static boolean joins(const Segment &prev, const Segment &next);
+    static void startSegment();
+    static void startMove();
+    static void updateAhead();
     boolean _paused;
     byte _pinmask;
     volatile long _remaining;
+    volatile long _position;
+    volatile uint32_t _steps;
     byte _dir;
-    
-    // The three of these are related to slow operation.
+    // Direction the gears were last taken up in, by a segment that has started
+    volatile byte _slackDir;
+    // Slack still to take up in lastDirection, when a stop cut the takeup short
+    unsigned int _slackOwed;
+
+    // Speed of the current move relative to full speed, in 16.16 fixed point
+    uint32_t _speed;
 
-    // How many timer triggers that are skipped between batches for the slowdown
-    volatile int cyclesToWait;
-    // Counts the number of timer triggers remaining to wait out for the current slowdown
-    volatile int _remainingCyclesToSlowdown;
-    // Number of pulses remaining in batch.
-    volatile byte _remainingInBatch;
+    // The trapezoidal profile of the current move. All of it is scaled by the
+    // speed, so motors moving at different speeds speed up and slow down in
+    // proportion and keep to the path between them.
+    static uint32_t accelPerTick;
+    uint32_t _cruiseRate;
+    uint32_t _startRate;
+    uint32_t _accel;
+    volatile uint32_t _rate;
+    uint32_t _phase;
+    // Steps taken while accelerating, and so needed to decelerate again
+    volatile long _rampSteps;
+    // Steps in the queued segments that join on to this one, so it doesn't
+    // slow down before them
+    volatile long _ahead;
+    void startRamp();
 
-    byte nextStep();
-    void setStep(byte);
-    void setNextStep();
-    void setNextStepFullspeed();
-    void setNextStepSlowdown();
-    void trigger();
-    byte currentStep;
+    // The rate one tick on in the profile
+    uint32_t rampedRate(uint32_t rate, boolean decelerating);
+    // Ticks until this motor's next step (at most MAX_INTERRUPT_TICKS)
+    uint32_t ticksToStep();
+    // Moves the profile on by the given ticks, stepping if one was due
+    void setNextStep(uint32_t ticks);
+    void trigger(uint32_t ticks);
+    // Position in the half-step sequence, and how far to move along it each
+    // step (7 goes backwards, as the position wraps around)
+    byte _stepIndex;
+    byte _stepDelta;
+    // This motor's bits in the shift register, for each position in the
+    // sequence and for the whole motor
+    uint8_t _stepBits[8];
+    uint8_t _mask;
     static int data_pin;
     static int clock_pin;
     static int latch_pin;
-    int microCounter;
-    int motor_offset;
+    static boolean useSPI;
+    static boolean hardwareLatch;
     static uint8_t lastBits;
     static uint8_t currentBits;
-    void updateBits(uint8_t bits);
     static void sendBits();
     static void startTimer();
     static void stopTimer();